@@ -1,19 +1,514 @@
+#define _GNU_SOURCE // splice(), recvmmsg(), sendmmsg()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
 #include <arpa/inet.h>
+#include "vehicle_ring.h"
 
 #define PORT 5000
 #define BUFFER_SIZE 100
 //#define VEHICLE_FILE "vehicles.data"
 #define SIMULATOR_PORT 7000  
+#define RECONNECT_DELAY 1
+#define SPLICE_CHUNK 65536 // bytes moved per splice() call, also the pipe size
+#define UDP_BATCH 64 // datagrams per recvmmsg()/sendmmsg() call
+#define UDP_RECEIVE_BUFFER (4 << 20)
+#define UDP_REPORT_SEC 5
+#define MAX_SHARDS 16
+#define SHARD_REPLICAS 64 // points per simulator instance on the hash ring
+#define SHARD_BUFFER 65536 // bytes of records queued per simulator instance
 
-int main() {
+// One simulator instance of a sharded setup
+typedef struct {
+    int port;
+    int socket;      // -1 while the instance is down
+    time_t retryAt;  // next reconnect attempt while down
+    int pendingBytes;
+    char pending[SHARD_BUFFER];  // records not yet taken by the socket
+} Shard;
+
+typedef struct {
+    uint32_t point;
+    int shard;
+} RingPoint;
+
+// Consistent-hash ring over the shards: an approach belongs to the first shard
+// point at or after its hash, so losing or adding a shard only moves the
+// approaches that hash next to its points
+typedef struct {
+    Shard shards[MAX_SHARDS];
+    int shardCount;
+    RingPoint ring[MAX_SHARDS * SHARD_REPLICAS];
+    int pointCount;
+    time_t nextHealthCheck;
+} ShardMap;
+
+// One attempt to connect to a simulator, -1 if it is not up
+int connectPort(int port) {
+    int simulator_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (simulator_socket < 0) {
+        perror("Simulator socket failed");
+        exit(EXIT_FAILURE);
+    }
+
+    struct sockaddr_in simulator_addr;
+    simulator_addr.sin_family = AF_INET;
+    simulator_addr.sin_port = htons(port);
+    simulator_addr.sin_addr.s_addr = INADDR_ANY;
+
+    if (connect(simulator_socket, (struct sockaddr*)&simulator_addr, sizeof(simulator_addr)) == 0) {
+        printf("Connected to simulator on port %d\n", port);
+        return simulator_socket;
+    }
+    close(simulator_socket);
+    return -1;
+}
+
+// Connect to the simulator, retrying until it is up
+int connectSimulator() {
+    int simulator_socket;
+    while ((simulator_socket = connectPort(SIMULATOR_PORT)) < 0) {
+        perror("Failed to connect to simulator");
+        sleep(RECONNECT_DELAY);
+    }
+    return simulator_socket;
+}
+
+// Blocking send of the whole buffer. While the simulator is not reading this
+// waits, and so does the generator behind us: TCP flow control end to end.
+int sendAll(int sock, const char* data, int length) {
+    while (length > 0) {
+        ssize_t sent = send(sock, data, length, MSG_NOSIGNAL);
+        if (sent < 0) return -1;
+        data += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+// ** Copy mode: read each message into user space, log it and send it on **
+void forwardCopy(int client_socket, int* simulator_socket) {
+    char buffer[BUFFER_SIZE] = {0};
+
+    while (1) {
+        int bytes_read = read(client_socket, buffer, BUFFER_SIZE - 1);
+        if (bytes_read <= 0) {
+            printf("Client disconnected.\n");
+            return;
+        }
+
+      
+        buffer[bytes_read] = '\0'; // Null-terminate received data
+        printf("Received: %s\n", buffer);
+
+        // Forward vehicle data to simulator
+        while (sendAll(*simulator_socket, buffer, bytes_read) < 0) {
+            perror("Forward to simulator failed");
+            close(*simulator_socket);
+            *simulator_socket = connectSimulator();
+        }
+        printf("Forwarded data to simulator: %s", buffer);
+    }
+}
+
+// ** Sharded mode **
+
+// FNV-1a followed by a finalizer, so nearby keys land far apart on the ring
+uint32_t hashBytes(const void* data, size_t length) {
+    const uint8_t* bytes = data;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+int compareRingPoints(const void* a, const void* b) {
+    uint32_t pa = ((const RingPoint*)a)->point, pb = ((const RingPoint*)b)->point;
+    return (pa > pb) - (pa < pb);
+}
+
+// Parse "7000,7002,..." into shards and place them on the ring
+bool parseShards(const char* list, ShardMap* map) {
+    memset(map, 0, sizeof(*map));
+    char copy[256];
+    snprintf(copy, sizeof(copy), "%s", list);
+    for (char* item = strtok(copy, ","); item; item = strtok(NULL, ",")) {
+        int port = atoi(item);
+        if (port <= 0 || port > 65535 || map->shardCount == MAX_SHARDS) return false;
+        Shard* shard = &map->shards[map->shardCount];
+        shard->port = port;
+        shard->socket = -1;
+        for (int replica = 0; replica < SHARD_REPLICAS; replica++) {
+            int key[2] = {port, replica};
+            map->ring[map->pointCount].point = hashBytes(key, sizeof(key));
+            map->ring[map->pointCount].shard = map->shardCount;
+            map->pointCount++;
+        }
+        map->shardCount++;
+    }
+    qsort(map->ring, map->pointCount, sizeof(RingPoint), compareRingPoints);
+    return map->shardCount > 0;
+}
+
+void markShardDown(Shard* shard) {
+    printf("Simulator on port %d went away, re-routing its approaches (%d queued bytes lost)\n", shard->port,
+           shard->pendingBytes);
+    close(shard->socket);
+    shard->socket = -1;
+    shard->pendingBytes = 0;
+    shard->retryAt = time(NULL) + RECONNECT_DELAY;
+}
+
+// Health check: a simulator never writes on the record connection, so a
+// readable or hung-up socket means it closed. Down shards are retried.
+void checkShards(ShardMap* map) {
+    time_t now = time(NULL);
+    map->nextHealthCheck = now + RECONNECT_DELAY;
+    for (int i = 0; i < map->shardCount; i++) {
+        Shard* shard = &map->shards[i];
+        if (shard->socket >= 0) {
+            struct pollfd check = {shard->socket, POLLIN | POLLRDHUP, 0};
+            if (poll(&check, 1, 0) > 0) markShardDown(shard);
+        } else if (now >= shard->retryAt) {
+            shard->socket = connectPort(shard->port);
+            if (shard->socket >= 0) fcntl(shard->socket, F_SETFL, O_NONBLOCK);
+            shard->retryAt = now + RECONNECT_DELAY;
+        }
+    }
+}
+
+// First live shard at or after the approach's point on the ring, -1 if none is up
+int routeLane(const ShardMap* map, char lane) {
+    uint32_t hash = hashBytes(&lane, 1);
+    int lo = 0, hi = map->pointCount;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (map->ring[mid].point < hash) lo = mid + 1;
+        else hi = mid;
+    }
+    for (int n = 0; n < map->pointCount; n++) {
+        int shard = map->ring[(lo + n) % map->pointCount].shard;
+        if (map->shards[shard].socket >= 0) return shard;
+    }
+    return -1;
+}
+
+// Hand as much of a shard's queue to its socket as it takes without blocking
+void flushShard(Shard* shard) {
+    if (shard->socket < 0 || shard->pendingBytes == 0) return;
+    ssize_t sent = send(shard->socket, shard->pending, shard->pendingBytes, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) markShardDown(shard);
+        return;
+    }
+    shard->pendingBytes -= sent;
+    memmove(shard->pending, shard->pending + sent, shard->pendingBytes);
+}
+
+// Queue one record for the shard owning its approach; false if that shard's
+// queue is full or no shard is up, so the caller holds the record back
+bool queueRecord(ShardMap* map, const char* record, int length, char lane) {
+    int index = routeLane(map, lane);
+    if (index < 0) return false;
+    Shard* shard = &map->shards[index];
+    if (shard->pendingBytes + length > SHARD_BUFFER) return false;
+    memcpy(shard->pending + shard->pendingBytes, record, length);
+    shard->pendingBytes += length;
+    printf("Forwarded to simulator on port %d: %.*s", shard->port, length, record);
+    return true;
+}
+
+// ** Sharded mode: route each record by approach to one of several simulators **
+// Each simulator has its own bounded queue, drained with non-blocking sends as
+// poll() reports room. A simulator that pushes back only holds up reading
+// once its own queue is full; the other simulators keep draining until then.
+void forwardSharded(int client_socket, ShardMap* map) {
+    char buffer[BUFFER_SIZE];
+    int buffered = 0;
+    bool clientOpen = true;
+    bool stalled = false;  // a complete record is waiting for room in its shard
+    time_t nextWarning = 0;
+
+    while (1) {
+        if (time(NULL) >= map->nextHealthCheck) checkShards(map);
+
+        // Queue the complete records held in buffer, oldest first
+        char* record = buffer;
+        char* newline;
+        stalled = false;
+        while ((newline = memchr(record, '\n', buffered - (record - buffer)))) {
+            char* colon = memchr(record, ':', newline - record);
+            if (colon && colon + 1 < newline && !queueRecord(map, record, newline + 1 - record, colon[1])) {
+                stalled = true;
+                break;
+            }
+            record = newline + 1;
+        }
+        buffered -= record - buffer;
+        memmove(buffer, record, buffered);
+        if (!stalled && buffered == BUFFER_SIZE - 1) buffered = 0;  // no newline in a full buffer: discard it
+
+        struct pollfd fds[MAX_SHARDS + 1];
+        int owner[MAX_SHARDS + 1];
+        int count = 0;
+        bool pending = false;
+        for (int i = 0; i < map->shardCount; i++) {
+            Shard* shard = &map->shards[i];
+            if (shard->socket < 0 || shard->pendingBytes == 0) continue;
+            pending = true;
+            fds[count] = (struct pollfd){shard->socket, POLLOUT, 0};
+            owner[count++] = i;
+        }
+        if (clientOpen && !stalled) {
+            fds[count] = (struct pollfd){client_socket, POLLIN, 0};
+            owner[count++] = -1;
+        }
+        if (!clientOpen && !pending && !stalled) {
+            printf("Client disconnected.\n");
+            return;
+        }
+        if (stalled && !pending && time(NULL) >= nextWarning) {
+            printf("No simulator is up, waiting...\n");
+            nextWarning = time(NULL) + RECONNECT_DELAY;
+        }
+
+        if (poll(fds, count, RECONNECT_DELAY * 1000) < 0) {
+            if (errno != EINTR) perror("Poll failed");
+            continue;
+        }
+        for (int i = 0; i < count; i++) {
+            if (!fds[i].revents) continue;
+            if (owner[i] >= 0) {
+                if (fds[i].revents & (POLLERR | POLLHUP)) markShardDown(&map->shards[owner[i]]);
+                else flushShard(&map->shards[owner[i]]);
+                continue;
+            }
+            int bytes_read = read(client_socket, buffer + buffered, BUFFER_SIZE - 1 - buffered);
+            if (bytes_read <= 0) clientOpen = false;
+            else buffered += bytes_read;
+        }
+    }
+}
+
+// ** Splice mode: move bytes socket -> pipe -> socket inside the kernel **
+// Nothing is copied to user space and one splice pair moves every record
+// that is queued, so there is no per-vehicle logging in this mode.
+void forwardSplice(int client_socket, int* simulator_socket, int pipefd[2]) {
+    long long forwarded = 0;
+
+    while (1) {
+        ssize_t in = splice(client_socket, NULL, pipefd[1], NULL, SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in <= 0) {
+            if (in < 0) perror("Splice from client failed");
+            printf("Client disconnected (%lld bytes forwarded).\n", forwarded);
+            return;
+        }
+
+        // Drain what entered the pipe; blocks while the simulator is not reading
+        while (in > 0) {
+            ssize_t out = splice(pipefd[0], NULL, *simulator_socket, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0) {
+                perror("Forward to simulator failed");
+                close(*simulator_socket);
+                *simulator_socket = connectSimulator();
+                continue;  // the unsent bytes are still in the pipe
+            }
+            in -= out;
+            forwarded += out;
+        }
+    }
+}
+
+// ** Shared-memory mode: parse records and push them into the ring **
+// The simulator reads the ring directly, so records skip the loopback socket.
+// A full ring blocks the push, and with it reads from the generator.
+void forwardShm(int client_socket, VehicleRing* ring) {
+    char buffer[BUFFER_SIZE];
+    int buffered = 0;
+    long long forwarded = 0;
+
+    while (1) {
+        int bytes_read = read(client_socket, buffer + buffered, BUFFER_SIZE - 1 - buffered);
+        if (bytes_read <= 0) {
+            printf("Client disconnected (%lld vehicles forwarded).\n", forwarded);
+            return;
+        }
+        buffered += bytes_read;
+        buffer[buffered] = '\0';
+
+        char* record = buffer;
+        char* newline;
+        while ((newline = strchr(record, '\n'))) {
+            *newline = '\0';
+            char* colon = strchr(record, ':');
+            if (colon && colon - record == PLATE_LENGTH && colon[1]) {
+                VehicleRecord vehicle = {0};
+                memcpy(vehicle.plate, record, PLATE_LENGTH);
+                vehicle.lane = colon[1];
+                vehicleRingPush(ring, &vehicle);
+                forwarded++;
+            }
+            record = newline + 1;
+        }
+        buffered = strlen(record);
+        if (buffered == BUFFER_SIZE - 1) buffered = 0;  // no newline in a full buffer: discard it
+        memmove(buffer, record, buffered);
+    }
+}
+
+// ** UDP mode: relay batches of datagrams to the simulator's UDP port **
+// One recvmmsg() fills up to UDP_BATCH pre-allocated buffers and one sendmmsg()
+// relays them unchanged, so each record costs a fraction of a syscall. There
+// is no backpressure: datagrams the simulator cannot take are lost and show up
+// in its loss counters.
+void forwardUdp(int udp_socket, int simulator_socket) {
+    static VehicleDatagram datagrams[UDP_BATCH];
+    struct mmsghdr messages[UDP_BATCH], relay[UDP_BATCH];
+    struct iovec iov[UDP_BATCH], relayIov[UDP_BATCH];
+    DatagramLoss loss = {0};
+    unsigned long long relayed = 0;
+
+    memset(messages, 0, sizeof(messages));
+    memset(relay, 0, sizeof(relay));
+    for (int i = 0; i < UDP_BATCH; i++) {
+        iov[i].iov_base = &datagrams[i];
+        iov[i].iov_len = sizeof(VehicleDatagram);
+        messages[i].msg_hdr.msg_iov = &iov[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+        relay[i].msg_hdr.msg_iov = &relayIov[i];
+        relay[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    time_t nextReport = time(NULL) + UDP_REPORT_SEC;
+    while (1) {
+        int received = recvmmsg(udp_socket, messages, UDP_BATCH, MSG_WAITFORONE, NULL);
+        if (received < 0) {
+            if (errno != EINTR) perror("Receive failed");
+            continue;
+        }
+
+        // Relay the well-formed datagrams, trimmed to their received length
+        int count = 0;
+        for (int i = 0; i < received; i++) {
+            if (!trackDatagram(&loss, &datagrams[i], messages[i].msg_len)) continue;
+            relayIov[count].iov_base = &datagrams[i];
+            relayIov[count].iov_len = messages[i].msg_len;
+            count++;
+        }
+        for (int sent = 0; sent < count;) {
+            int n = sendmmsg(simulator_socket, relay + sent, count - sent, 0);
+            if (n < 0) {
+                // Refused means the simulator is not up yet: drop the batch
+                if (errno != ECONNREFUSED && errno != EINTR) perror("Forward to simulator failed");
+                if (errno != EINTR) break;
+                continue;
+            }
+            sent += n;
+            relayed += n;
+        }
+
+        if (time(NULL) >= nextReport) {
+            nextReport = time(NULL) + UDP_REPORT_SEC;
+            printf("Received %llu records in %llu datagrams from %d sources, %llu lost, %llu late, %llu relayed\n",
+                   (unsigned long long)loss.records, (unsigned long long)loss.datagrams, loss.sources,
+                   (unsigned long long)loss.lost, (unsigned long long)loss.late, relayed);
+        }
+    }
+}
+
+// Datagram socket bound to the receiver port and one connected to the simulator
+void startUdp() {
+    int udp_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    int simulator_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (udp_socket < 0 || simulator_socket < 0) {
+        perror("Socket failed");
+        exit(EXIT_FAILURE);
+    }
+    int size = UDP_RECEIVE_BUFFER;
+    setsockopt(udp_socket, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(PORT);
+    if (bind(udp_socket, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        perror("Bind failed");
+        exit(EXIT_FAILURE);
+    }
+
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(SIMULATOR_PORT);
+    if (connect(simulator_socket, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        perror("Failed to connect to simulator");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Server listening on UDP port %d, relaying to UDP port %d...\n", PORT, SIMULATOR_PORT);
+    forwardUdp(udp_socket, simulator_socket);
+}
+
+int main(int argc, char* argv[]) {
     int server_fd, new_socket;
     struct sockaddr_in address;
     int addrlen = sizeof(address);
-    char buffer[BUFFER_SIZE] = {0};
+    bool useSplice = false, useShm = false, useUdp = false;
+    const char* shardList = NULL;
+    static ShardMap shardMap;
+    int pipefd[2];
+    VehicleRing* ring = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--splice") == 0) {
+            useSplice = true;
+        } else if (strcmp(argv[i], "--shm") == 0) {
+            useShm = true;
+        } else if (strcmp(argv[i], "--udp") == 0) {
+            useUdp = true;
+        } else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+            shardList = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--splice | --shm | --udp | --shards PORT,PORT,...]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (useSplice + useShm + useUdp + (shardList != NULL) > 1) {
+        fprintf(stderr, "--splice, --shm, --udp and --shards are alternative forwarding modes\n");
+        exit(EXIT_FAILURE);
+    }
+    if (shardList && !parseShards(shardList, &shardMap)) {
+        fprintf(stderr, "--shards takes up to %d comma separated simulator ports\n", MAX_SHARDS);
+        exit(EXIT_FAILURE);
+    }
+    if (useUdp) {
+        startUdp();
+        return 0;
+    }
+
+    if (useShm && !(ring = vehicleRingOpen(VEHICLE_RING_NAME))) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (useSplice) {
+        if (pipe2(pipefd, O_CLOEXEC) < 0) {
+            perror("Pipe failed");
+            exit(EXIT_FAILURE);
+        }
+        fcntl(pipefd[1], F_SETPIPE_SZ, SPLICE_CHUNK);
+    }
 
     // Create socket
     if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
@@ -39,7 +534,17 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
-    printf("Server listening on port %d...\n", PORT);
+    printf("Server listening on port %d (%s forwarding)...\n", PORT,
+           shardList ? "sharded" : useShm ? "shared-memory" : useSplice ? "splice" : "copy");
+
+    // One long-lived connection keeps the records in order and lets the
+    // simulator push back when its lanes are full
+    int simulator_socket = -1;
+    if (shardList) {
+        checkShards(&shardMap);
+    } else if (!useShm) {
+        simulator_socket = connectSimulator();
+    }
 
     while (1) {
         new_socket = accept(server_fd, (struct sockaddr*)&address, (socklen_t*)&addrlen);
@@ -50,41 +555,19 @@ int main() {
 
         printf("Client connected...\n");
 
-        while (1) {
-            int bytes_read = read(new_socket, buffer, BUFFER_SIZE);
-            if (bytes_read <= 0) {
-                printf("Client disconnected.\n");
-                close(new_socket);
-                break;
-            }
-
-          
-            buffer[bytes_read] = '\0'; // Null-terminate received data
-            printf("Received: %s\n", buffer);
-
-            // Forward vehicle data to simulator
-            int simulator_socket = socket(AF_INET, SOCK_STREAM, 0);
-            if (simulator_socket < 0) {
-                perror("Simulator socket failed");
-                continue;
-            }
-
-            struct sockaddr_in simulator_addr;
-            simulator_addr.sin_family = AF_INET;
-            simulator_addr.sin_port = htons(SIMULATOR_PORT);
-            simulator_addr.sin_addr.s_addr = INADDR_ANY;
-
-            if (connect(simulator_socket, (struct sockaddr*)&simulator_addr, sizeof(simulator_addr)) == 0) {
-                send(simulator_socket, buffer, strlen(buffer), 0);
-                printf("Forwarded data to simulator: %s\n", buffer);
-            } else {
-                perror("Failed to connect to simulator");
-            }
-
-            close(simulator_socket);  // Close after each message
+        if (shardList) {
+            forwardSharded(new_socket, &shardMap);
+        } else if (useShm) {
+            forwardShm(new_socket, ring);
+        } else if (useSplice) {
+            forwardSplice(new_socket, &simulator_socket, pipefd);
+        } else {
+            forwardCopy(new_socket, &simulator_socket);
         }
+        close(new_socket);
     }
 
+    if (simulator_socket >= 0) close(simulator_socket);
     close(server_fd);
     return 0;
 }
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // recvmmsg()
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_ttf.h>
 #include <stdbool.h>
@@ -6,150 +7,710 @@
 #include <unistd.h> 
 #include <stdio.h> 
 #include <string.h>
+#include <stdint.h>
 #include <arpa/inet.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include "vehicle_ring.h"
+#include "trace.h"
 
 #define SIMULATOR_PORT 7000
 #define BUFFER_SIZE 100
 
 #define MAX_LINE_LENGTH 20
 #define MAIN_FONT "/usr/share/fonts/TTF/DejaVuSans.ttf"
+#define JUNCTION_CONFIG "junction.conf"
+#define TRACE_FILE "trace.json"
 #define WINDOW_WIDTH 800
 #define WINDOW_HEIGHT 800
 #define SCALE 1
-#define ROAD_WIDTH 150
-#define LANE_WIDTH 50
 #define ARROW_SIZE 15
-
-#define VEHICLE_HEIGHT 10
-#define VEHICLE_WIDTH 17
+#define LOD_DENSITY 200     // vehicles in a lane before it is drawn aggregated, needs --lane-capacity above it
+#define HEATMAP_TILE 8      // window pixels per heatmap texel
+#define HEATMAP_COLUMNS (WINDOW_WIDTH / HEATMAP_TILE)
+#define HEATMAP_ROWS (WINDOW_HEIGHT / HEATMAP_TILE)
+#define HEATMAP_SATURATION 16 // vehicles in a tile drawn at full intensity
+#define RECT_BATCH 512      // rectangles per SDL_RenderFillRects() call
 
 #define BOX_WIDTH 25
 #define BOX_HEIGHT 25
 #define LIGHT_WIDTH 12
 #define LIGHT_HEIGHT 12
-#define FREE_VEHICLE_SPEED 7
-#define CENTRAL_VEHICLE_SPEED 4
 #define TIME_PER_VEHICLE 3
+#define TICK_MS 50 // default simulation step
+#define DEFAULT_LANE_CAPACITY 64
+#define DEFAULT_SPILL_CAPACITY 256
+#define MAX_SPILL 4096
+#define PLATE_INDEX_MIN 1024 // initial slots of the plate index
+#define ADMISSION_REPORT_SEC 10
+#define TICK_REPORT_SEC 10
+#define JITTER_BUCKET_US 10
+#define JITTER_BUCKETS 2000 // 20 ms range, later samples count in the last bucket
+#define UDP_BATCH 64              // datagrams drained per recvmmsg() call
+#define UDP_RECEIVE_BUFFER (4 << 20)
+#define MAX_SCENARIOS 64
+#define MAX_SWEEP_RUNS 4096
+#define SCENARIO_NAME_LENGTH 32
+#define DEFAULT_ACCEL 200 // px/s^2 when a lane does not set one
+
+#define MAX_LANES 16
+#define MAX_SIGNALS 8
+#define MAX_ROADS 26
+#define CONFIG_LINE_LENGTH 256
+#define NO_LINE (-1000000) // lane has no stop line / turn point
+
+// Lane coordinates are fixed-point pixels with FIXED_SHIFT fractional bits
+#define FIXED_SHIFT 8
+#define TO_FIXED(px) ((fixed_t)(px) * (1 << FIXED_SHIFT))
+#define FROM_FIXED(f) ((int)((f) >> FIXED_SHIFT))
+
+typedef int32_t fixed_t;
 
 typedef struct {
     bool isRed;
 } TrafficLight;
 
-TrafficLight trafficLights[4];  // Global array for 4 lights
+typedef enum { LANE_FREE, LANE_CENTRAL } LaneKind;
+
+// One lane of the junction, precomputed from the layout file.
+// Vehicles move along a 1D lane coordinate s measured from the spawn point,
+// so the stop line and turn point are single numbers whatever the heading.
+typedef struct {
+    char road;              // approach letter sent by the generator
+    LaneKind kind;
+    int spawnX, spawnY;
+    int dx, dy;             // heading up to the turn point
+    int turnX, turnY;       // screen position of the turn point
+    int turnDx, turnDy;     // heading after the turn point
+    fixed_t turnS;          // lane coordinate of the turn, or NO_LINE
+    fixed_t stopS;          // lane coordinate of the stop line, or NO_LINE
+    fixed_t gap;            // minimum spacing to the vehicle ahead
+    fixed_t speed;          // cruise speed, px/s
+    fixed_t accel;          // px/s^2, also used for braking
+    int signal;             // index into the lights, -1 when unsignalled
+    int width, height;      // drawn vehicle size
+} LanePath;
+
+typedef struct {
+    char label;
+    SDL_Rect greenBox, redBox;
+    SDL_Rect greenLamp, redLamp;
+} SignalGroup;
+
+typedef struct {
+    int roadWidth, laneWidth;
+    int laneCount;
+    LanePath lanes[MAX_LANES];
+    int signalCount;
+    SignalGroup signals[MAX_SIGNALS];  // in green cycle order
+    int priorityLane;                  // lane watched by the priority rule, -1 for none
+    int roadLaneCount[MAX_ROADS];
+    int roadLanes[MAX_ROADS][MAX_LANES];
+} JunctionLayout;
+
+JunctionLayout junction;
 
 typedef struct LaneVehicle {
-    int x, y;
-    int speed;
-    char lane;
+    fixed_t s;      // distance travelled along the lane
+    fixed_t v;      // px/s
+    fixed_t accel;  // px/s^2
+    fixed_t maxSpeed;
+    int x, y;       // screen position derived from s
+    int lane;       // index into junction.lanes
+    int32_t waitMs; // time spent stopped
+    int32_t carry;  // movement below 1/1000 of a fixed-point unit left over from the last step
+    uint64_t plate; // packed number plate, 0 if unknown
     struct LaneVehicle* next;
 } LaneVehicle;
 
 typedef struct{
 LaneVehicle* front;
 LaneVehicle* rear;
+int count;
 } LaneQueue;
 
-LaneQueue freeLaneQueues[4] = {{NULL, NULL}, {NULL, NULL}, {NULL, NULL}, {NULL, NULL}};
-LaneQueue centralLaneQueues[4] = {{NULL, NULL}, {NULL, NULL}, {NULL, NULL}, {NULL, NULL}};
+// Open-addressing (linear probing) index of the vehicles in a simulation,
+// keyed by packed number plate
+typedef struct {
+    uint64_t plate;        // 0 marks an empty slot
+    LaneVehicle* vehicle;  // NULL while the vehicle waits in the spill buffer
+    int lane;
+} PlateSlot;
+
+typedef struct {
+    PlateSlot* slots;
+    uint32_t capacity;  // power of two, 0 before the first insert
+    uint32_t count;
+} PlateIndex;
+
+// What happens to an arrival when its lane is at capacity
+typedef enum { OVERFLOW_REJECT, OVERFLOW_DROP_OLDEST, OVERFLOW_SPILL } OverflowPolicy;
+
+typedef enum {
+    ADMIT_OK,
+    ADMIT_REJECTED,
+    ADMIT_DROPPED_OLDEST,  // admitted after dropping the lane's front vehicle
+    ADMIT_SPILLED,         // parked in the spill buffer until the lane has room
+    ADMIT_SPILL_FULL       // nothing done, caller must wait or give up
+} AdmitResult;
+
+// Signal cycle state, advanced once per second by stepSignalController()
+typedef struct {
+    int phase;          // signal group shown green, -1 before the first phase
+    int remaining;      // seconds of green left for phase
+    int cyclePosition;  // next group in the normal cycle
+    bool cycleStarted;  // priority lane already checked for this cycle
+    bool priorityHold;  // priority lane held green until it drains
+    bool priorityNext;  // priority lane jumps ahead of the next phase
+} SignalController;
+
+typedef struct {
+    int64_t arrivals;
+    int64_t departures;
+    int64_t waitMs;        // stopped time of departed vehicles
+    int64_t queueSamples;  // taken once per simulated second
+    int64_t queueTotal;    // stopped vehicles summed over the samples
+    int queueMax;
+    int64_t rejected;      // arrivals turned away
+    int64_t dropped;       // vehicles removed by drop-oldest
+    int64_t deferred;      // arrivals parked in the spill buffer
+    int64_t stalls;        // times ingest waited for spill space
+    int64_t duplicates;    // arrivals whose plate is already in the junction
+} SimulationStats;
+
+// Tumbling-window totals per approach and movement (straight through the
+// central lane or turning through the free lane), flushed when a window closes
+#define MOVEMENT_GROUPS (MAX_ROADS * 2)
+#define MOVEMENT_GROUP(path) (((path)->road - 'A') * 2 + ((path)->kind == LANE_FREE))
+
+typedef struct {
+    int windowTicks;          // window length, 0 when analytics are off
+    int ticks;                // ticks accumulated in the current window
+    uint64_t startTick;
+    uint32_t run;             // 0 for the interactive run, n for the n-th sweep run
+    uint32_t departures[MOVEMENT_GROUPS];
+    uint64_t queueTotal[MOVEMENT_GROUPS];  // stopped vehicles summed over the window's ticks
+    uint32_t queueMax[MOVEMENT_GROUPS];
+    uint32_t greenTicks[MOVEMENT_GROUPS];
+    uint32_t usedGreenTicks[MOVEMENT_GROUPS];  // green with vehicles in the lanes
+} AnalyticsWindow;
+
+// Everything one simulation run owns; the junction layout is shared read-only
+typedef struct {
+    LaneQueue laneQueues[MAX_LANES];
+    TrafficLight trafficLights[MAX_SIGNALS];  // One light per signal group
+    SignalController controller;
+    uint64_t tick;
+    int tickMs;
+    int timePerVehicle;    // signal policy: green seconds per 3 waiting vehicles
+    bool priorityEnabled;  // signal policy: apply the priority lane rules
+    bool verbose;          // print controller messages
+    bool heatmap;          // keep denseLanes and heatTiles up to date for the renderer
+    int laneCapacity;      // vehicles per lane, 0 for unbounded
+    OverflowPolicy overflow;
+    int spillCapacity;
+    int spill[MAX_SPILL];  // ring of lane indices waiting for room, oldest first
+    uint64_t spillPlates[MAX_SPILL];  // plate of each spill entry
+    int spillHead, spillCount;
+    int spilledPerLane[MAX_LANES];
+    PlateIndex plates;     // every vehicle with a known plate, in a lane or spilled
+    SimulationStats stats;
+    AnalyticsWindow analytics;
+} Simulation;
+
+Simulation simulation;  // the interactive run driven by the threads below
+
+// One row of a sweep file, run once per seed
+typedef struct {
+    char name[SCENARIO_NAME_LENGTH];
+    double rate;            // arrivals per second
+    double mix[MAX_ROADS];  // relative arrival weight per approach
+    int timePerVehicle;
+    bool priorityEnabled;
+    int seeds;
+    int durationSec;
+} Scenario;
+
+typedef struct {
+    const Scenario* scenario;
+    unsigned seed;
+    double throughput;  // vehicles per hour
+    double meanQueue;
+    int maxQueue;
+    double meanWait;    // seconds stopped per departed vehicle
+    int64_t lost;       // arrivals rejected or dropped by admission control
+} SweepRun;
+
+#define ANALYTICS_MAGIC {'J', 'S', 'I', 'M', 'A', 'N', 'L', 'T'}
+#define ANALYTICS_VERSION 1
+#define ANALYTICS_WINDOW_SEC 60
+
+#define CHECKPOINT_MAGIC {'J', 'S', 'I', 'M', 'C', 'K', 'P', 'T'}
+#define CHECKPOINT_VERSION 5
+#define CHECKPOINT_EVERY_SEC 60
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t laneCount;
+    uint32_t signalCount;
+    uint32_t tickMs;
+    uint64_t layoutFingerprint;
+    uint64_t tick;
+} CheckpointHeader;
+
+typedef struct {
+    uint8_t* data;
+    size_t size, capacity;
+} CheckpointBuffer;
+
+// simLock guards the lane queues, lights and controller across threads
+pthread_mutex_t simLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t admissionSpace = PTHREAD_COND_INITIALIZER;  // a tick may have freed lane room
+pthread_mutex_t checkpointLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t checkpointReady = PTHREAD_COND_INITIALIZER;
+CheckpointBuffer checkpointBuffer;
+bool checkpointPending = false;  // buffer handed to checkpointWriter
+const char* checkpointPath = NULL;
+bool useShmTransport = false;  // ingest from the shared-memory ring instead of TCP
+bool useUdpTransport = false;  // ingest batched datagrams instead of TCP
+int simulatorPort = SIMULATOR_PORT;  // vehicle records; control commands on the next port
+int checkpointEverySec = CHECKPOINT_EVERY_SEC;
+uint64_t nextCheckpointTick = 0;
+int lodDensity = LOD_DENSITY;  // 0 always draws every vehicle
+bool denseLanes[MAX_LANES];    // lanes drawn aggregated, as of the last update
+uint16_t heatTiles[HEATMAP_ROWS][HEATMAP_COLUMNS];  // vehicles of the dense lanes per heatmap tile
+FILE* analyticsFile = NULL;    // append-only window blocks, shared by sweep workers
+pthread_mutex_t analyticsLock = PTHREAD_MUTEX_INITIALIZER;
+int updateCpu = -1, ingestCpu = -1;  // CPU to pin the thread to, -1 to let the OS choose
+int fifoPriority = 0;                // SCHED_FIFO priority for update and ingest, 0 for normal scheduling
+
+// Distribution of tick timing errors in JITTER_BUCKET_US buckets
+typedef struct {
+    uint32_t counts[JITTER_BUCKETS];
+    uint32_t samples;
+    int64_t maxUs;
+} JitterHistogram;
 
 bool initializeSDL(SDL_Window **window, SDL_Renderer **renderer);
+bool loadJunctionLayout(const char* path, JunctionLayout* layout);
 void drawRoadsAndLane(SDL_Renderer *renderer, TTF_Font *font);
 void displayText(SDL_Renderer *renderer, TTF_Font *font, char *text, int x, int y);
 void refreshTrafficLight(void* arg);
+void initSimulation(Simulation* sim);
+void resetSignalController(Simulation* sim);
+void stepSignalController(Simulation* sim);
+void snapshotSimulation(const Simulation* sim);
+void* checkpointWriter(void* arg);
+bool restoreCheckpoint(Simulation* sim, const char* filePath);
+int runSweep(const char* sweepFile, int jobs, const Simulation* base, const char* restorePath, const char* resultsPath);
 void drawTrafficLights(SDL_Renderer *renderer);
 void updateVehicles(void* arg);
-void drawFreeLaneVehicles(SDL_Renderer* renderer);
-void drawCentralLaneVehicles(SDL_Renderer* renderer);
-void enqueueFreeLaneVehicle(int x, int y, int speed, char lane);
-void enqueueCentralLaneVehicle(int x, int y, int speed, char lane);
-void dequeueCentralLaneVehicles();
-void dequeueFreeLaneVehicle();
-void updateFreeLaneVehiclePositions();
+void drawLaneVehicles(SDL_Renderer* renderer);
+void enqueueLaneVehicle(Simulation* sim, int lane, uint64_t plate);
+AdmitResult admitVehicle(Simulation* sim, int lane, uint64_t plate);
+void dequeueLaneVehicles(Simulation* sim);
+int updateLaneVehiclePositions(Simulation* sim, int dtMs);
 void *LaneControl(void *arg);
 
 
 bool running = true;
 
 
-void enqueueCentralLaneVehicle(int x, int y, int speed, char lane){
-    LaneVehicle* newVehicle = (LaneVehicle*)malloc(sizeof(LaneVehicle));
-    newVehicle->x = x;
-    newVehicle->y = y;
-    newVehicle->speed = speed;
-    newVehicle->lane = lane;
-    newVehicle->next = NULL;
+static const char* TOKEN_SEPARATORS = " \t\r\n";
+
+static bool nextInt(int* out) {
+    char* token = strtok(NULL, TOKEN_SEPARATORS);
+    if (!token) return false;
+    char* end;
+    long value = strtol(token, &end, 10);
+    if (*end != '\0') return false;
+    *out = (int)value;
+    return true;
+}
+
+static bool nextDouble(double* out) {
+    char* token = strtok(NULL, TOKEN_SEPARATORS);
+    if (!token) return false;
+    char* end;
+    *out = strtod(token, &end);
+    return *end == '\0';
+}
+
+static bool nextChar(char* out) {
+    char* token = strtok(NULL, TOKEN_SEPARATORS);
+    if (!token || strlen(token) != 1) return false;
+    *out = token[0];
+    return true;
+}
+
+static bool nextLaneKind(LaneKind* out) {
+    char* token = strtok(NULL, TOKEN_SEPARATORS);
+    if (!token) return false;
+    if (strcmp(token, "free") == 0) *out = LANE_FREE;
+    else if (strcmp(token, "central") == 0) *out = LANE_CENTRAL;
+    else return false;
+    return true;
+}
+
+static bool isUnitHeading(int dx, int dy) {
+    return abs(dx) + abs(dy) == 1;
+}
 
-    int laneIndex = lane - 'A'; // Convert A, B, C, D to 0, 1, 2, 3
-   
-    if (laneIndex < 0 || laneIndex > 3) return;  // Ignore invalid lane
+static int findSignal(const JunctionLayout* layout, char label) {
+    for (int i = 0; i < layout->signalCount; i++) {
+        if (layout->signals[i].label == label) return i;
+    }
+    return -1;
+}
+
+static int findLane(const JunctionLayout* layout, char road, LaneKind kind) {
+    for (int i = 0; i < layout->laneCount; i++) {
+        if (layout->lanes[i].road == road && layout->lanes[i].kind == kind) return i;
+    }
+    return -1;
+}
+
+// Lamps sit in the middle of their boxes
+static SDL_Rect lampInBox(SDL_Rect box) {
+    SDL_Rect lamp = {box.x + BOX_HEIGHT/2 - LIGHT_HEIGHT/2, box.y + BOX_HEIGHT/2 - LIGHT_HEIGHT/2, LIGHT_WIDTH, LIGHT_HEIGHT};
+    return lamp;
+}
+
+// signal <label> <green box x y> <red box x y>
+static bool parseSignal(JunctionLayout* layout) {
+    if (layout->signalCount == MAX_SIGNALS) return false;
+    SignalGroup* group = &layout->signals[layout->signalCount];
+    if (!nextChar(&group->label) || findSignal(layout, group->label) != -1) return false;
+    group->greenBox.w = group->redBox.w = BOX_WIDTH;
+    group->greenBox.h = group->redBox.h = BOX_HEIGHT;
+    if (!nextInt(&group->greenBox.x) || !nextInt(&group->greenBox.y) ||
+        !nextInt(&group->redBox.x) || !nextInt(&group->redBox.y)) return false;
+    group->greenLamp = lampInBox(group->greenBox);
+    group->redLamp = lampInBox(group->redBox);
+    layout->signalCount++;
+    return true;
+}
+
+// lane <road> <free|central> followed by keyed fields:
+//   spawn <x> <y>  heading <dx> <dy>  turn <coord> <dx> <dy>
+//   stop <coord>  signal <label>  gap <px>  speed <px/s>  accel <px/s^2>  size <w> <h>
+// stop and turn coordinates are on the axis of travel.
+static bool parseLane(JunctionLayout* layout) {
+    if (layout->laneCount == MAX_LANES) return false;
+    LanePath* path = &layout->lanes[layout->laneCount];
+    memset(path, 0, sizeof(*path));
+    path->turnS = NO_LINE;
+    path->stopS = NO_LINE;
+    path->signal = -1;
+
+    if (!nextChar(&path->road) || path->road < 'A' || path->road > 'Z') return false;
+    if (!nextLaneKind(&path->kind)) return false;
+    if (findLane(layout, path->road, path->kind) != -1) return false;
+
+    int turnCoord = NO_LINE, stopCoord = NO_LINE;
+    int gap = 0, speed = 0, accel = DEFAULT_ACCEL;
+    bool turns = false;
+    char* key;
+    while ((key = strtok(NULL, TOKEN_SEPARATORS))) {
+        if (strcmp(key, "spawn") == 0) {
+            if (!nextInt(&path->spawnX) || !nextInt(&path->spawnY)) return false;
+        } else if (strcmp(key, "heading") == 0) {
+            if (!nextInt(&path->dx) || !nextInt(&path->dy)) return false;
+        } else if (strcmp(key, "turn") == 0) {
+            if (!nextInt(&turnCoord) || !nextInt(&path->turnDx) || !nextInt(&path->turnDy)) return false;
+            turns = true;
+        } else if (strcmp(key, "stop") == 0) {
+            if (!nextInt(&stopCoord)) return false;
+        } else if (strcmp(key, "signal") == 0) {
+            char label;
+            if (!nextChar(&label) || (path->signal = findSignal(layout, label)) == -1) return false;
+        } else if (strcmp(key, "gap") == 0) {
+            if (!nextInt(&gap)) return false;
+        } else if (strcmp(key, "speed") == 0) {
+            if (!nextInt(&speed)) return false;
+        } else if (strcmp(key, "accel") == 0) {
+            if (!nextInt(&accel)) return false;
+        } else if (strcmp(key, "size") == 0) {
+            if (!nextInt(&path->width) || !nextInt(&path->height)) return false;
+        } else {
+            return false;
+        }
+    }
 
-    if (centralLaneQueues[laneIndex].front == NULL) {
-        centralLaneQueues[laneIndex].front = centralLaneQueues[laneIndex].rear = newVehicle;
+    if (!isUnitHeading(path->dx, path->dy)) return false;
+    if (speed <= 0 || accel <= 0 || gap < 0 || path->width <= 0 || path->height <= 0) return false;
+    if ((stopCoord != NO_LINE) != (path->signal != -1)) return false;  // a stop line needs a light
+    path->gap = TO_FIXED(gap);
+    path->speed = TO_FIXED(speed);
+    path->accel = TO_FIXED(accel);
+
+    // Axis coordinates -> distance from the spawn point
+    int sign = path->dx + path->dy;
+    int spawnProgress = path->spawnX * path->dx + path->spawnY * path->dy;
+    if (stopCoord != NO_LINE) {
+        int stopDistance = stopCoord * sign - spawnProgress;
+        if (stopDistance < 0) return false;
+        path->stopS = TO_FIXED(stopDistance);
+    }
+    if (turns) {
+        int turnDistance = turnCoord * sign - spawnProgress;
+        if (!isUnitHeading(path->turnDx, path->turnDy) || turnDistance < 0) return false;
+        path->turnS = TO_FIXED(turnDistance);
+        path->turnX = path->spawnX + path->dx * turnDistance;
+        path->turnY = path->spawnY + path->dy * turnDistance;
     } else {
-        centralLaneQueues[laneIndex].rear->next = newVehicle;
-        centralLaneQueues[laneIndex].rear = newVehicle;
+        path->turnDx = path->dx;
+        path->turnDy = path->dy;
+    }
+
+    int road = path->road - 'A';
+    layout->roadLanes[road][layout->roadLaneCount[road]++] = layout->laneCount;
+    layout->laneCount++;
+    return true;
+}
+
+// ** Read the junction description and build the per-lane tables **
+bool loadJunctionLayout(const char* filePath, JunctionLayout* layout) {
+    FILE* file = fopen(filePath, "r");
+    if (!file) {
+        perror(filePath);
+        return false;
+    }
+
+    memset(layout, 0, sizeof(*layout));
+    layout->priorityLane = -1;
+    char priorityRoad = 0;
+    LaneKind priorityKind = LANE_CENTRAL;
+
+    char line[CONFIG_LINE_LENGTH];
+    int lineNumber = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file)) {
+        lineNumber++;
+        char* hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+
+        char* directive = strtok(line, TOKEN_SEPARATORS);
+        if (!directive) continue;
+
+        if (strcmp(directive, "road_width") == 0) {
+            ok = nextInt(&layout->roadWidth);
+        } else if (strcmp(directive, "lane_width") == 0) {
+            ok = nextInt(&layout->laneWidth);
+        } else if (strcmp(directive, "signal") == 0) {
+            ok = parseSignal(layout);
+        } else if (strcmp(directive, "lane") == 0) {
+            ok = parseLane(layout);
+        } else if (strcmp(directive, "priority") == 0) {
+            ok = nextChar(&priorityRoad) && nextLaneKind(&priorityKind);
+        } else {
+            ok = false;
+        }
+        if (!ok) fprintf(stderr, "%s:%d: invalid '%s' entry\n", filePath, lineNumber, directive);
+    }
+    fclose(file);
+    if (!ok) return false;
+
+    if (layout->laneCount == 0) {
+        fprintf(stderr, "%s: no lanes defined\n", filePath);
+        return false;
+    }
+    if (priorityRoad) {
+        layout->priorityLane = findLane(layout, priorityRoad, priorityKind);
+        if (layout->priorityLane == -1 || layout->lanes[layout->priorityLane].signal == -1) {
+            fprintf(stderr, "%s: priority lane %c must be a signalled lane\n", filePath, priorityRoad);
+            return false;
+        }
+    }
+
+    printf("Loaded junction %s: %d lanes, %d signal groups\n", filePath, layout->laneCount, layout->signalCount);
+    return true;
+}
+
+// ** Plate index **
+
+// Pack up to PLATE_LENGTH characters of a plate into a key, 0 for no plate
+uint64_t packPlate(const char* plate, size_t length) {
+    uint64_t key = 0;
+    if (length > PLATE_LENGTH) length = PLATE_LENGTH;
+    memcpy(&key, plate, length);
+    return key;
+}
+
+static void unpackPlate(uint64_t key, char* plate) {
+    memcpy(plate, &key, PLATE_LENGTH);
+    plate[PLATE_LENGTH] = '\0';
+}
+
+static uint32_t plateHome(const PlateIndex* index, uint64_t plate) {
+    return (uint32_t)((plate * 0x9E3779B97F4A7C15ULL) >> 32) & (index->capacity - 1);
+}
+
+PlateSlot* findPlate(const PlateIndex* index, uint64_t plate) {
+    if (index->capacity == 0 || plate == 0) return NULL;
+    for (uint32_t i = plateHome(index, plate);; i = (i + 1) & (index->capacity - 1)) {
+        if (index->slots[i].plate == plate) return &index->slots[i];
+        if (index->slots[i].plate == 0) return NULL;
     }
-};
+}
+
+static void growPlateIndex(PlateIndex* index) {
+    PlateIndex grown = {0};
+    grown.capacity = index->capacity ? index->capacity * 2 : PLATE_INDEX_MIN;
+    grown.slots = calloc(grown.capacity, sizeof(PlateSlot));
+    for (uint32_t n = 0; n < index->capacity; n++) {
+        if (index->slots[n].plate == 0) continue;
+        uint32_t i = plateHome(&grown, index->slots[n].plate);
+        while (grown.slots[i].plate) i = (i + 1) & (grown.capacity - 1);
+        grown.slots[i] = index->slots[n];
+        grown.count++;
+    }
+    free(index->slots);
+    *index = grown;
+}
+
+// Add a plate or move it to a new place; kept at most half full
+static void indexPlate(PlateIndex* index, uint64_t plate, int lane, LaneVehicle* vehicle) {
+    if (plate == 0) return;
+    PlateSlot* slot = findPlate(index, plate);
+    if (!slot) {
+        if ((index->count + 1) * 2 > index->capacity) growPlateIndex(index);
+        uint32_t i = plateHome(index, plate);
+        while (index->slots[i].plate) i = (i + 1) & (index->capacity - 1);
+        slot = &index->slots[i];
+        slot->plate = plate;
+        index->count++;
+    }
+    slot->lane = lane;
+    slot->vehicle = vehicle;
+}
+
+// Remove a plate, shifting later entries of its probe run back so lookups
+// never need tombstones
+static void unindexPlate(PlateIndex* index, uint64_t plate) {
+    PlateSlot* slot = findPlate(index, plate);
+    if (!slot) return;
+    uint32_t mask = index->capacity - 1;
+    uint32_t hole = (uint32_t)(slot - index->slots);
+    for (uint32_t i = (hole + 1) & mask; index->slots[i].plate; i = (i + 1) & mask) {
+        uint32_t home = plateHome(index, index->slots[i].plate);
+        // Move the entry unless its home lies cyclically in (hole, i]
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            index->slots[hole] = index->slots[i];
+            hole = i;
+        }
+    }
+    index->slots[hole].plate = 0;
+    index->count--;
+}
+
+// ** Enqueue vehicle at the spawn point of its lane **
+void enqueueLaneVehicle(Simulation* sim, int lane, uint64_t plate) {
+    if (lane < 0 || lane >= junction.laneCount) return;  // Ignore invalid lane
+    const LanePath* path = &junction.lanes[lane];
 
-// ** Enqueue vehicle into the correct lane queue **
-void enqueueFreeLaneVehicle(int x, int y, int speed, char lane) {
     LaneVehicle* newVehicle = (LaneVehicle*)malloc(sizeof(LaneVehicle));
-    newVehicle->x = x;
-    newVehicle->y = y;
-    newVehicle->speed = speed;
+    newVehicle->s = 0;
+    newVehicle->v = path->speed;  // vehicles enter at cruise speed
+    newVehicle->accel = path->accel;
+    newVehicle->maxSpeed = path->speed;
+    newVehicle->x = path->spawnX;
+    newVehicle->y = path->spawnY;
     newVehicle->lane = lane;
+    newVehicle->waitMs = 0;
+    newVehicle->carry = 0;
+    newVehicle->plate = plate;
     newVehicle->next = NULL;
+    indexPlate(&sim->plates, plate, lane, newVehicle);
 
-    int laneIndex = lane - 'A'; // Convert A, B, C, D to 0, 1, 2, 3
-   
-    if (laneIndex < 0 || laneIndex > 3) return;  // Ignore invalid lane
-
-    if (freeLaneQueues[laneIndex].front == NULL) {
-        freeLaneQueues[laneIndex].front = freeLaneQueues[laneIndex].rear = newVehicle;
+    LaneQueue* queue = &sim->laneQueues[lane];
+    if (queue->front == NULL) {
+        queue->front = queue->rear = newVehicle;
     } else {
-        freeLaneQueues[laneIndex].rear->next = newVehicle;
-        freeLaneQueues[laneIndex].rear = newVehicle;
+        queue->rear->next = newVehicle;
+        queue->rear = newVehicle;
     }
+    queue->count++;
+    sim->stats.arrivals++;
 }
 
-void dequeueCentralLaneVehicles() {
-    for (int i = 0; i < 4; i++) {
-        LaneVehicle* current = centralLaneQueues[i].front;
-        LaneVehicle* prev = NULL;
-
-        while (current) {
-            if (current->x > WINDOW_WIDTH || current->y > WINDOW_HEIGHT ||
-                current->x < 0 || current->y < 0) {
-
-                LaneVehicle* toDelete = current;
-                current = current->next;
+static void dropFrontVehicle(Simulation* sim, int lane) {
+    LaneQueue* queue = &sim->laneQueues[lane];
+    LaneVehicle* front = queue->front;
+    if (!front) return;
+    queue->front = front->next;
+    if (queue->front == NULL) queue->rear = NULL;
+    queue->count--;
+    unindexPlate(&sim->plates, front->plate);
+    free(front);
+}
 
-                if (prev == NULL) { // If deleting head
-                    centralLaneQueues[i].front = current;
-                } else {
-                    prev->next = current;
-                }
+// ** Admit an arrival into its lane, applying the lane capacity **
+AdmitResult admitVehicle(Simulation* sim, int lane, uint64_t plate) {
+    LaneQueue* queue = &sim->laneQueues[lane];
+    // Arrivals never overtake vehicles of the same lane still in the spill buffer
+    if (sim->spilledPerLane[lane] == 0 && (sim->laneCapacity == 0 || queue->count < sim->laneCapacity)) {
+        enqueueLaneVehicle(sim, lane, plate);
+        return ADMIT_OK;
+    }
 
-                free(toDelete);
-            } else {
-                prev = current;
-                current = current->next;
+    switch (sim->overflow) {
+        case OVERFLOW_REJECT:
+            sim->stats.rejected++;
+            return ADMIT_REJECTED;
+        case OVERFLOW_DROP_OLDEST:
+            if (sim->spilledPerLane[lane] == 0) {
+                dropFrontVehicle(sim, lane);
+                sim->stats.dropped++;
+                enqueueLaneVehicle(sim, lane, plate);
+                return ADMIT_DROPPED_OLDEST;
             }
-        }
+            // Only reachable if the policy changed while vehicles were spilled
+            // fall through
+        case OVERFLOW_SPILL:
+            if (sim->spillCount >= sim->spillCapacity) return ADMIT_SPILL_FULL;
+            sim->spill[(sim->spillHead + sim->spillCount) % MAX_SPILL] = lane;
+            sim->spillPlates[(sim->spillHead + sim->spillCount) % MAX_SPILL] = plate;
+            sim->spillCount++;
+            sim->spilledPerLane[lane]++;
+            indexPlate(&sim->plates, plate, lane, NULL);
+            sim->stats.deferred++;
+            return ADMIT_SPILLED;
+    }
+    return ADMIT_REJECTED;
+}
 
-        if (centralLaneQueues[i].front == NULL) {
-            centralLaneQueues[i].rear = NULL;
+// ** Move spilled arrivals into lanes that have room again, oldest first **
+static void drainSpill(Simulation* sim) {
+    int kept = 0;
+    for (int n = 0; n < sim->spillCount; n++) {
+        int lane = sim->spill[(sim->spillHead + n) % MAX_SPILL];
+        uint64_t plate = sim->spillPlates[(sim->spillHead + n) % MAX_SPILL];
+        if (sim->laneCapacity == 0 || sim->laneQueues[lane].count < sim->laneCapacity) {
+            enqueueLaneVehicle(sim, lane, plate);
+            sim->spilledPerLane[lane]--;
+        } else {
+            sim->spill[(sim->spillHead + kept) % MAX_SPILL] = lane;
+            sim->spillPlates[(sim->spillHead + kept) % MAX_SPILL] = plate;
+            kept++;
         }
     }
+    sim->spillCount = kept;
 }
 
 // ** Remove vehicles that have moved out of screen bounds **
-void dequeueFreeLaneVehicles() {
-    for (int i = 0; i < 4; i++) {
-        LaneVehicle* current = freeLaneQueues[i].front;
+void dequeueLaneVehicles(Simulation* sim) {
+    for (int i = 0; i < junction.laneCount; i++) {
+        LaneQueue* queue = &sim->laneQueues[i];
+        LaneVehicle* current = queue->front;
         LaneVehicle* prev = NULL;
 
         while (current) {
@@ -160,11 +721,16 @@ void dequeueFreeLaneVehicles() {
                 current = current->next;
 
                 if (prev == NULL) { // If deleting head
-                    freeLaneQueues[i].front = current;
+                    queue->front = current;
                 } else {
                     prev->next = current;
                 }
 
+                queue->count--;
+                sim->stats.departures++;
+                sim->stats.waitMs += toDelete->waitMs;
+                sim->analytics.departures[MOVEMENT_GROUP(&junction.lanes[i])]++;
+                unindexPlate(&sim->plates, toDelete->plate);
                 free(toDelete);
             } else {
                 prev = current;
@@ -172,303 +738,1241 @@ void dequeueFreeLaneVehicles() {
             }
         }
 
-        if (freeLaneQueues[i].front == NULL) {
-            freeLaneQueues[i].rear = NULL;
+        if (queue->front == NULL) {
+            queue->rear = NULL;
+        } else {
+            queue->rear = prev;
         }
     }
 }
 
-void updateCentralLaneVehiclePositions() {
-    for (int i = 0; i < 4; i++) {
-        LaneVehicle* current = centralLaneQueues[i].front;
-        LaneVehicle* prev = NULL;
+static int64_t isqrt64(int64_t n) {
+    if (n <= 0) return 0;
+    int64_t root = 0, bit = (int64_t)1 << 62;
+    while (bit > n) bit >>= 2;
+    while (bit) {
+        if (n >= root + bit) {
+            n -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return root;
+}
 
-        while (current) {
-            bool canMove= false;
+// ** Map a lane coordinate back to screen space **
+static void placeOnLane(const LanePath* path, LaneVehicle* vehicle) {
+    if (path->turnS != NO_LINE && vehicle->s > path->turnS) {
+        int past = FROM_FIXED(vehicle->s - path->turnS);
+        vehicle->x = path->turnX + path->turnDx * past;
+        vehicle->y = path->turnY + path->turnDy * past;
+    } else {
+        int along = FROM_FIXED(vehicle->s);
+        vehicle->x = path->spawnX + path->dx * along;
+        vehicle->y = path->spawnY + path->dy * along;
+    }
+}
 
-            if(!prev){
-                canMove = true;
-            }
+// ** Integrate one vehicle over dtMs **
+// The vehicle never passes its limit (a red stop line or the gap behind the
+// vehicle ahead), and brakes so it could stop there, whatever the tick length.
+static void stepLaneVehicle(const Simulation* sim, const LanePath* path, LaneVehicle* current, const LaneVehicle* prev, int dtMs) {
+    int64_t limit = INT64_MAX;
+    if (path->stopS != NO_LINE && current->s <= path->stopS && sim->trafficLights[path->signal].isRed) {
+        limit = path->stopS;
+    }
+    if (prev && (int64_t)prev->s - path->gap < limit) {
+        limit = (int64_t)prev->s - path->gap;
+    }
 
-            if (prev && prev->lane == current->lane) {
-                 // Default to false unless a valid condition is met
-            
-                if (current->lane == 'D' && (prev->x - current->x) > (VEHICLE_WIDTH + 15)) {
-                    canMove = true;
-                } 
-                else if (current->lane == 'A' && (prev->y - current->y) > (VEHICLE_WIDTH + 15)) {
-                    canMove = true;
-                } 
-                else if (current->lane == 'C' && (current->x - prev->x) > (VEHICLE_WIDTH + 15)) {
-                    canMove = true;
-                } 
-                else if (current->lane == 'B' && (current->y - prev->y) > (VEHICLE_WIDTH + 15)) {
-                    canMove = true;
-                }
-            }
-            
-
-            switch (current->lane) {
-                
-                case 'D':
-                if (current->x <= WINDOW_WIDTH/2-ROAD_WIDTH/2-VEHICLE_WIDTH){
-                    if(!trafficLights[0].isRed){
-                        current->x += current->speed;  //keept it moving.
-                    }else{
-                        if(current->x < WINDOW_WIDTH/2-ROAD_WIDTH/2-VEHICLE_WIDTH){
-                            if(canMove){current->x += current->speed;}  //keept it moving.
-                        }
-                    }
-                }else{
-                    current->x += current->speed;  //keept it moving.
-                } 
-                break; // Right-moving
-                case 'A': 
-
-                if (current->y <= WINDOW_HEIGHT/2-ROAD_WIDTH/2-VEHICLE_HEIGHT){
-                    if(!trafficLights[1].isRed){
-                        current->y += current->speed;  //keept it moving.
-                    }else{
-                        if(current->y < WINDOW_HEIGHT/2-ROAD_WIDTH/2-VEHICLE_HEIGHT){
-                            if(canMove){current->y += current->speed;}  //keept it moving.
-                        }
-                    }
-                }else{
-                    current->y += current->speed;  //keept it moving.
-                }
-                break; // Down-moving
-                case 'C': 
-                 
-                if (current->x >= WINDOW_WIDTH/2+ROAD_WIDTH/2){
-                    if(!trafficLights[2].isRed){
-                        current->x -= current->speed;  //keept it moving.
-                    }else{
-                        if(current->x > WINDOW_WIDTH/2+ROAD_WIDTH/2){
-                            if(canMove){current->x -= current->speed;}  //keept it moving.
-                        }
-                    }
-                }else{
-                    current->x -= current->speed;  //keept it moving.
-                }
-                break;// Left-moving
-                case 'B': 
-
-                if (current->y >= WINDOW_HEIGHT/2+ROAD_WIDTH/2){
-                    if(!trafficLights[3].isRed){
-                        current->y -= current->speed;  //keept it moving.
-                    }else{
-                        if(current->y > WINDOW_HEIGHT/2+ROAD_WIDTH/2){
-                            if(canMove){current->y -= current->speed;}  //keept it moving.
-                        }
-                    }
-                }else{
-                    current->y -= current->speed;  //keept it moving.
-                }
-                break; // Up-moving
-            }
-            prev= current;
-            current = current->next;
+    int64_t target = current->maxSpeed;
+    if (limit != INT64_MAX) {
+        int64_t room = limit - current->s;
+        if (room <= 0) {
+            current->v = 0;
+            current->carry = 0;
+            current->waitMs += dtMs;
+            return;
+        }
+        // Fastest speed that can still stop within the room: v^2 = 2*a*d
+        int64_t safe = isqrt64(2 * (int64_t)current->accel * room);
+        if (safe < target) target = safe;
+    }
+
+    int64_t v = current->v;
+    if (v < target) {
+        v += (int64_t)current->accel * dtMs / 1000;
+        if (v > target) v = target;
+    } else {
+        v = target;
+    }
+
+    // Carry what truncation drops, so short ticks add up to the same distance
+    // as long ones and a crawling vehicle still reaches its limit
+    int64_t travel = v * dtMs + current->carry;
+    int64_t s = current->s + travel / 1000;
+    current->carry = (int32_t)(travel % 1000);
+    if (s >= limit) {
+        s = limit;
+        current->carry = 0;
+    }
+    current->v = (fixed_t)v;
+    current->s = (fixed_t)s;
+    if (v == 0) current->waitMs += dtMs;
+    placeOnLane(path, current);
+}
+
+// ** Analytics **
+// The file starts with ANALYTICS_MAGIC and a uint32 version, followed by one
+// block per closed window, native endian:
+//   uint32 run, uint32 rows, uint32 windowMs, uint64 startMs
+// then each column for all rows in turn:
+//   uint8 road, uint8 movement (0 straight, 1 turn), uint32 departures,
+//   float meanQueue, uint32 maxQueue, float greenShare, float greenUtilization
+// greenShare and greenUtilization are -1 for unsignalled movements.
+
+// Open for appending, writing the file header if the file is new
+bool openAnalytics(const char* path) {
+    analyticsFile = fopen(path, "ab");
+    if (!analyticsFile) {
+        perror(path);
+        return false;
+    }
+    if (ftell(analyticsFile) == 0) {
+        const char magic[8] = ANALYTICS_MAGIC;
+        uint32_t version = ANALYTICS_VERSION;
+        fwrite(magic, sizeof(magic), 1, analyticsFile);
+        fwrite(&version, sizeof(version), 1, analyticsFile);
+    }
+    return true;
+}
+
+// ** Write the closed window as one columnar block **
+static void writeAnalyticsWindow(const Simulation* sim) {
+    const AnalyticsWindow* w = &sim->analytics;
+    bool present[MOVEMENT_GROUPS] = {false}, signalled[MOVEMENT_GROUPS] = {false};
+    for (int i = 0; i < junction.laneCount; i++) {
+        present[MOVEMENT_GROUP(&junction.lanes[i])] = true;
+        if (junction.lanes[i].signal != -1) signalled[MOVEMENT_GROUP(&junction.lanes[i])] = true;
+    }
+
+    int rows = 0;
+    uint8_t road[MOVEMENT_GROUPS], movement[MOVEMENT_GROUPS];
+    uint32_t departures[MOVEMENT_GROUPS], maxQueue[MOVEMENT_GROUPS];
+    float meanQueue[MOVEMENT_GROUPS], greenShare[MOVEMENT_GROUPS], greenUtilization[MOVEMENT_GROUPS];
+    for (int g = 0; g < MOVEMENT_GROUPS; g++) {
+        if (!present[g]) continue;
+        road[rows] = 'A' + g / 2;
+        movement[rows] = g % 2;
+        departures[rows] = w->departures[g];
+        meanQueue[rows] = (float)w->queueTotal[g] / w->ticks;
+        maxQueue[rows] = w->queueMax[g];
+        greenShare[rows] = signalled[g] ? (float)w->greenTicks[g] / w->ticks : -1;
+        greenUtilization[rows] = signalled[g] && w->greenTicks[g] ? (float)w->usedGreenTicks[g] / w->greenTicks[g] : -1;
+        rows++;
+    }
+
+    uint32_t header[3] = {w->run, (uint32_t)rows, (uint32_t)(w->ticks * sim->tickMs)};
+    uint64_t startMs = w->startTick * sim->tickMs;
+    pthread_mutex_lock(&analyticsLock);
+    fwrite(header, sizeof(header), 1, analyticsFile);
+    fwrite(&startMs, sizeof(startMs), 1, analyticsFile);
+    fwrite(road, sizeof(*road), rows, analyticsFile);
+    fwrite(movement, sizeof(*movement), rows, analyticsFile);
+    fwrite(departures, sizeof(*departures), rows, analyticsFile);
+    fwrite(meanQueue, sizeof(*meanQueue), rows, analyticsFile);
+    fwrite(maxQueue, sizeof(*maxQueue), rows, analyticsFile);
+    fwrite(greenShare, sizeof(*greenShare), rows, analyticsFile);
+    fwrite(greenUtilization, sizeof(*greenUtilization), rows, analyticsFile);
+    if (fflush(analyticsFile) != 0) perror("Analytics write failed");
+    pthread_mutex_unlock(&analyticsLock);
+}
+
+// ** Write out a partly filled window and start the next one empty **
+void flushAnalytics(Simulation* sim) {
+    AnalyticsWindow* w = &sim->analytics;
+    if (w->ticks == 0 || !analyticsFile) return;
+    writeAnalyticsWindow(sim);
+    AnalyticsWindow next = {.windowTicks = w->windowTicks, .run = w->run};  // keep the settings
+    *w = next;
+}
+
+// ** Sample queues and lights once per tick, closing the window when full **
+// waiting[i] is the number of stopped vehicles in lane i: the queue length.
+static void analyticsTick(Simulation* sim, const int* waiting) {
+    AnalyticsWindow* w = &sim->analytics;
+    if (w->windowTicks == 0 || !analyticsFile) return;
+    if (w->ticks == 0) w->startTick = sim->tick;
+
+    uint32_t queued[MOVEMENT_GROUPS] = {0};
+    bool occupied[MOVEMENT_GROUPS] = {false}, green[MOVEMENT_GROUPS] = {false};
+    for (int i = 0; i < junction.laneCount; i++) {
+        const LanePath* path = &junction.lanes[i];
+        queued[MOVEMENT_GROUP(path)] += waiting[i];
+        if (sim->laneQueues[i].count) occupied[MOVEMENT_GROUP(path)] = true;
+        if (path->signal != -1 && !sim->trafficLights[path->signal].isRed) green[MOVEMENT_GROUP(path)] = true;
+    }
+    for (int g = 0; g < MOVEMENT_GROUPS; g++) {
+        w->queueTotal[g] += queued[g];
+        if (queued[g] > w->queueMax[g]) w->queueMax[g] = queued[g];
+        if (green[g]) {
+            w->greenTicks[g]++;
+            if (occupied[g]) w->usedGreenTicks[g]++;
         }
-        dequeueCentralLaneVehicles();
     }
+
+    if (++w->ticks == w->windowTicks) flushAnalytics(sim);
 }
 
 // ** Move vehicles forward **
-void updateFreeLaneVehiclePositions() {
-    for (int i = 0; i < 4; i++) {
-        LaneVehicle* current = freeLaneQueues[i].front;
+// Returns the number of stopped vehicles, the queue length of the junction.
+int updateLaneVehiclePositions(Simulation* sim, int dtMs) {
+    TRACE_SCOPE("update positions");
+    int waiting[MAX_LANES] = {0};
+    int stopped = 0;
+    if (sim->heatmap) memset(heatTiles, 0, sizeof(heatTiles));
+    for (int i = 0; i < junction.laneCount; i++) {
+        const LanePath* path = &junction.lanes[i];
+        LaneVehicle* current = sim->laneQueues[i].front;
+        LaneVehicle* prev = NULL;
+        // Bin dense lanes here, while every vehicle is visited anyway, so
+        // drawing them costs the same however many vehicles they hold
+        bool dense = sim->heatmap && lodDensity > 0 && sim->laneQueues[i].count > lodDensity;
+        if (sim->heatmap) denseLanes[i] = dense;
 
         while (current) {
-            switch (current->lane) {
-                
-                case 'D': 
-                
-                if (current->x > WINDOW_WIDTH/2-ROAD_WIDTH/2+5){
-                    current->y -= current->speed; }
-                else{
-                    current->x += current->speed; 
-                }
-                break; // Right-moving
-                case 'A': 
-                if (current->y > WINDOW_HEIGHT/2-ROAD_WIDTH/2+5){
-                    current->x += current->speed;  }
-                else{
-                    current->y += current->speed; 
+            stepLaneVehicle(sim, path, current, prev, dtMs);
+            if (current->v == 0) {
+                waiting[i]++;
+                stopped++;
+            }
+            if (dense) {
+                int column = current->x / HEATMAP_TILE, row = current->y / HEATMAP_TILE;
+                if (column >= 0 && column < HEATMAP_COLUMNS && row >= 0 && row < HEATMAP_ROWS &&
+                    heatTiles[row][column] < UINT16_MAX) {
+                    heatTiles[row][column]++;
                 }
-                break; // Down-moving
-                case 'C': 
-                if (current->x < WINDOW_WIDTH/2+ROAD_WIDTH/2-VEHICLE_WIDTH-5){
-                    current->y += current->speed;} 
-                else{
-                    current->x -= current->speed;
-                }    
-                break; // Left-moving
-                case 'B': 
-                if (current->y < WINDOW_HEIGHT/2+ROAD_WIDTH/2-VEHICLE_HEIGHT-5){
-                    current->x -= current->speed;} 
-                else{
-                    current->y -= current->speed;
-                }    
-                break; // Up-moving
             }
+            prev = current;
             current = current->next;
         }
-        dequeueFreeLaneVehicles();
     }
+    dequeueLaneVehicles(sim);
+    drainSpill(sim);
+    analyticsTick(sim, waiting);
+    return stopped;
 }
 
-void drawCentralLaneVehicles(SDL_Renderer* renderer) {
-    SDL_SetRenderDrawColor(renderer, 200, 0, 0, 255);
+// Distance from the spawn point to where the lane's queue forms
+static int queueSpan(const LanePath* path) {
+    if (path->stopS != NO_LINE) return FROM_FIXED(path->stopS);
+    if (path->turnS != NO_LINE) return FROM_FIXED(path->turnS);
+    return path->dx ? WINDOW_WIDTH : WINDOW_HEIGHT;
+}
 
-    for (int i = 0; i < 4; i++) {
-        LaneVehicle* current = centralLaneQueues[i].front;
-        SDL_Rect vehicleRect;
-        while (current) {
-            if(current->lane == 'D' || current->lane == 'C'){
-                vehicleRect.x= current->x;
-                vehicleRect.y= current->y;
-                vehicleRect.w= VEHICLE_WIDTH;
-                vehicleRect.h= VEHICLE_HEIGHT;
-            }
-            if(current->lane == 'A' || current->lane == 'B'){
-                vehicleRect.x= current->x;
-                vehicleRect.y= current->y;
-                vehicleRect.w= VEHICLE_HEIGHT;
-                vehicleRect.h= VEHICLE_WIDTH;
-            }
-            
-            
-            SDL_RenderFillRect(renderer, &vehicleRect);
-            current = current->next;
+// ** Aggregated view of a dense lane: a bar growing from the spawn point **
+// Its length saturates towards the full queue span as the count grows.
+static SDL_Rect queueBar(const LanePath* path, int count) {
+    int length = (int)((long long)queueSpan(path) * count / (count + lodDensity));
+    SDL_Rect bar = {path->spawnX, path->spawnY, path->width, path->height};
+    if (path->dx) {
+        bar.w = length;
+        if (path->dx < 0) bar.x += path->width - length;
+    } else {
+        bar.h = length;
+        if (path->dy < 0) bar.y += path->height - length;
+    }
+    return bar;
+}
+
+// ** Density of the aggregated lanes, streamed into a low-resolution texture **
+// The tiles are counted by updateLaneVehiclePositions().
+static void drawHeatmap(SDL_Renderer* renderer) {
+    static SDL_Texture* heatmap = NULL;
+    if (!heatmap) {
+        heatmap = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, HEATMAP_COLUMNS,
+                                    HEATMAP_ROWS);
+        if (!heatmap) return;
+        SDL_SetTextureBlendMode(heatmap, SDL_BLENDMODE_BLEND);
+    }
+
+    void* pixels;
+    int pitch;
+    if (SDL_LockTexture(heatmap, NULL, &pixels, &pitch) != 0) return;
+    for (int row = 0; row < HEATMAP_ROWS; row++) {
+        Uint32* texel = (Uint32*)((Uint8*)pixels + row * pitch);
+        for (int column = 0; column < HEATMAP_COLUMNS; column++) {
+            int tile = heatTiles[row][column];
+            int heat = tile >= HEATMAP_SATURATION ? 255 : tile * 255 / HEATMAP_SATURATION;
+            // Transparent when empty, yellow through red as the tile fills up
+            texel[column] = heat ? (Uint32)(160 + heat * 95 / 255) << 24 | 255u << 16 | (Uint32)(255 - heat) << 8 : 0;
         }
     }
+    SDL_UnlockTexture(heatmap);
+    SDL_RenderCopy(renderer, heatmap, NULL, NULL);
 }
 
-void drawFreeLaneVehicles(SDL_Renderer* renderer) {
+// ** Draw the vehicles, bounded by screen area rather than vehicle count **
+// Vehicles outside the window or stacked on the one drawn before are culled
+// and the rest are submitted in batches. Lanes holding more than lodDensity
+// vehicles are drawn as a queue bar over a density heatmap instead, from the
+// lane count alone.
+void drawLaneVehicles(SDL_Renderer* renderer) {
+    TRACE_SCOPE("draw vehicles");
+    static SDL_Rect batch[RECT_BATCH];
+    int batched = 0;
+    bool anyDense = false;
+
     SDL_SetRenderDrawColor(renderer, 200, 0, 0, 255);
+    for (int i = 0; i < junction.laneCount; i++) {
+        const LanePath* path = &junction.lanes[i];
+        if (denseLanes[i]) {
+            anyDense = true;
+            continue;
+        }
 
-    for (int i = 0; i < 4; i++) {
-        LaneVehicle* current = freeLaneQueues[i].front;
-        SDL_Rect vehicleRect;
-        while (current) {
-            if(current->lane == 'D' || current->lane == 'C'){
-                vehicleRect.x= current->x;
-                vehicleRect.y= current->y;
-                vehicleRect.w= VEHICLE_WIDTH;
-                vehicleRect.h= VEHICLE_HEIGHT;
+        const LaneVehicle* last = NULL;
+        for (LaneVehicle* current = simulation.laneQueues[i].front; current; current = current->next) {
+            if (current->x >= WINDOW_WIDTH || current->y >= WINDOW_HEIGHT ||
+                current->x + path->width <= 0 || current->y + path->height <= 0) {
+                continue;
             }
-            if(current->lane == 'A' || current->lane == 'B'){
-                vehicleRect.x= current->x;
-                vehicleRect.y= current->y;
-                vehicleRect.w= VEHICLE_HEIGHT;
-                vehicleRect.h= VEHICLE_WIDTH;
+            if (last && last->x == current->x && last->y == current->y) continue;
+            last = current;
+
+            batch[batched++] = (SDL_Rect){current->x, current->y, path->width, path->height};
+            if (batched == RECT_BATCH) {
+                SDL_RenderFillRects(renderer, batch, batched);
+                batched = 0;
             }
-            
-            
-            SDL_RenderFillRect(renderer, &vehicleRect);
-            current = current->next;
         }
     }
+    if (batched) SDL_RenderFillRects(renderer, batch, batched);
+    if (!anyDense) return;
+
+    drawHeatmap(renderer);
+    SDL_SetRenderDrawColor(renderer, 255, 160, 0, 255);  // Amber
+    for (int i = 0; i < junction.laneCount; i++) {
+        if (!denseLanes[i]) continue;
+        SDL_Rect bar = queueBar(&junction.lanes[i], simulation.laneQueues[i].count);
+        SDL_RenderFillRect(renderer, &bar);
+    }
+}
+
+// ** Pin the calling thread and raise it to SCHED_FIFO, as configured **
+static void configureThread(const char* name, int cpu) {
+    if (cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (error) fprintf(stderr, "Cannot pin %s thread to CPU %d: %s\n", name, cpu, strerror(error));
+    }
+    if (fifoPriority > 0) {
+        struct sched_param param = {.sched_priority = fifoPriority};
+        int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (error) fprintf(stderr, "Cannot run %s thread as SCHED_FIFO: %s\n", name, strerror(error));
+    }
+}
+
+static void recordJitter(JitterHistogram* histogram, int64_t us) {
+    if (us < 0) us = -us;
+    int64_t bucket = us / JITTER_BUCKET_US;
+    histogram->counts[bucket < JITTER_BUCKETS ? bucket : JITTER_BUCKETS - 1]++;
+    histogram->samples++;
+    if (us > histogram->maxUs) histogram->maxUs = us;
+}
+
+// Upper edge of the bucket holding the given fraction of samples, in ms
+static double jitterPercentile(const JitterHistogram* histogram, double fraction) {
+    uint64_t wanted = (uint64_t)ceil(histogram->samples * fraction);
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < JITTER_BUCKETS; bucket++) {
+        seen += histogram->counts[bucket];
+        if (seen >= wanted && seen > 0) return (bucket + 1) * JITTER_BUCKET_US / 1000.0;
+    }
+    return histogram->maxUs / 1000.0;
+}
+
+static void reportJitter(const char* label, const JitterHistogram* histogram) {
+    printf("  %s p50 %.2f ms, p99 %.2f ms, p99.9 %.2f ms, max %.2f ms\n", label,
+           jitterPercentile(histogram, 0.5), jitterPercentile(histogram, 0.99), jitterPercentile(histogram, 0.999),
+           histogram->maxUs / 1000.0);
+}
+
+static int64_t elapsedUs(const struct timespec* from, const struct timespec* to) {
+    return (int64_t)(to->tv_sec - from->tv_sec) * 1000000 + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+// simLock with the wait traced, to show contention between the threads
+static void lockSimulation() {
+    TRACE_SCOPE("wait simLock");
+    pthread_mutex_lock(&simLock);
 }
 
 // ** Thread Function to Update Vehicles **
+// Ticks run on absolute deadlines tickMs apart, so the period does not stretch
+// with the work done per tick. A tick that starts more than a whole period late
+// is an overrun: the missed ticks are skipped and the deadlines restart from now.
 void updateVehicles(void* arg){
     SDL_Renderer* renderer = (SDL_Renderer*)arg;
+    TRACE_THREAD("update");
+    configureThread("update", updateCpu);
+
+    static JitterHistogram lateness, period;  // wake-up after the deadline, deviation of the period
+    int64_t overruns = 0;
+    int reportTicks = TICK_REPORT_SEC * 1000 / simulation.tickMs;
+    if (reportTicks < 1) reportTicks = 1;  // ticks longer than the report interval
+    struct timespec deadline, woke, lastWoke;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    lastWoke = deadline;
+
     while(running){
-        
-        updateFreeLaneVehiclePositions();
-      
-        updateCentralLaneVehiclePositions();
-        
-        SDL_Delay(50); // Slows down the update rate for smoother movement
+        clock_gettime(CLOCK_MONOTONIC, &woke);
+        int64_t lateUs = elapsedUs(&deadline, &woke);
+        recordJitter(&lateness, lateUs);
+        if (lateness.samples > 1) recordJitter(&period, elapsedUs(&lastWoke, &woke) - simulation.tickMs * 1000);
+        lastWoke = woke;
+        if (lateUs > simulation.tickMs * 1000) {
+            overruns++;
+            deadline = woke;
+        }
+
+        lockSimulation();
+        updateLaneVehiclePositions(&simulation, simulation.tickMs);
+        simulation.tick++;
+        pthread_cond_broadcast(&admissionSpace);
+        if (checkpointPath && simulation.tick >= nextCheckpointTick) {
+            snapshotSimulation(&simulation);  // copy at the tick boundary, written out by checkpointWriter
+            nextCheckpointTick = simulation.tick + (uint64_t)checkpointEverySec * 1000 / simulation.tickMs;
+        }
+        pthread_mutex_unlock(&simLock);
+
+        if (lateness.samples >= (uint32_t)reportTicks) {
+            printf("Tick %d ms: %lld overruns in %u ticks\n", simulation.tickMs, (long long)overruns, lateness.samples);
+            reportJitter("wake-up delay", &lateness);
+            reportJitter("period error ", &period);
+            memset(&lateness, 0, sizeof(lateness));
+            memset(&period, 0, sizeof(period));
+            overruns = 0;
+        }
+
+        deadline.tv_nsec += (long)simulation.tickMs * 1000000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {}
     }
 }
 
-int countVehiclesInQueue(LaneVehicle* front) {
+// Vehicles waiting on signalled lanes other than the priority lane
+static int countOtherSignalledVehicles(const Simulation* sim) {
     int count = 0;
-    while (front) {
-        count++;
-        front = front->next;
+    for (int i = 0; i < junction.laneCount; i++) {
+        if (i != junction.priorityLane && junction.lanes[i].signal != -1) {
+            count += sim->laneQueues[i].count;
+        }
     }
     return count;
 }
 
+void resetSignalController(Simulation* sim) {
+    for (int i = 0; i < junction.signalCount; i++) {
+        sim->trafficLights[i].isRed = true;
+    }
+    memset(&sim->controller, 0, sizeof(sim->controller));
+    sim->controller.phase = -1;
+}
 
-void refreshTrafficLight(void* arg) {
-    for (int i = 0; i < 4; i++) {
-        trafficLights[i].isRed = true;
+// ** Empty junction with the default signal policy **
+void initSimulation(Simulation* sim) {
+    memset(sim, 0, sizeof(*sim));
+    sim->tickMs = TICK_MS;
+    sim->timePerVehicle = TIME_PER_VEHICLE;
+    sim->priorityEnabled = true;
+    sim->laneCapacity = DEFAULT_LANE_CAPACITY;
+    sim->overflow = OVERFLOW_SPILL;
+    sim->spillCapacity = DEFAULT_SPILL_CAPACITY;
+    resetSignalController(sim);
+}
+
+static void simLog(const Simulation* sim, const char* format, ...) {
+    if (!sim->verbose) return;
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+static void startGreen(Simulation* sim, int group) {
+    if (sim->controller.phase != -1) {
+        sim->trafficLights[sim->controller.phase].isRed = true; // Previous phase back to red
     }
+    sim->trafficLights[group].isRed = false; // Set current green
 
-    while (running) {
-        int laneA2Count = countVehiclesInQueue(centralLaneQueues[0].front); // Lane A2 count
-        printf("Lane A2 count: %d\n", laneA2Count);
+    int vehiclesCount = countOtherSignalledVehicles(sim);
+    int V = (vehiclesCount > 0) ? (vehiclesCount / 3) : 1;
+    if (V < 1) V = 1;
+
+    sim->controller.phase = group;
+    sim->controller.remaining = V * sim->timePerVehicle;
+}
+
+// ** Advance the signal cycle by one second **
+// All controller state lives in sim->controller so it can be checkpointed.
+void stepSignalController(Simulation* sim) {
+    TRACE_SCOPE("signal step");
+    SignalController* c = &sim->controller;
+    int prioritySignal = (sim->priorityEnabled && junction.priorityLane != -1) ? junction.lanes[junction.priorityLane].signal : -1;
+    int laneA2Count = (prioritySignal != -1) ? sim->laneQueues[junction.priorityLane].count : 0;
+
+    if (c->priorityHold) {
+        if (laneA2Count > 5) { // Keep green until below 5
+            simLog(sim, "Traffic Light %c: Lane A2 priority - %d vehicles remaining\n", junction.signals[prioritySignal].label, laneA2Count);
+            return;
+        }
+        simLog(sim, "Lane A2 priority mode ended, resuming normal cycle.\n");
+        c->priorityHold = false;
+        c->priorityNext = (laneA2Count == 5);
+    } else if (c->remaining == 0 && c->cyclePosition == 0 && !c->cycleStarted && prioritySignal != -1) {
+        simLog(sim, "Lane A2 count: %d\n", laneA2Count);
+        c->cycleStarted = true;
 
         // High priority case: If Lane A2 has more than 10 vehicles, force it to stay green
         if (laneA2Count > 10) {
-            printf("Lane A2 has HIGH priority, forcing GREEN light.\n");
+            simLog(sim, "Lane A2 has HIGH priority, forcing GREEN light.\n");
+            for (int j = 0; j < junction.signalCount; j++) {
+                sim->trafficLights[j].isRed = true;
+            }
+            sim->trafficLights[prioritySignal].isRed = false; // Force Lane A green
+            c->phase = prioritySignal;
+            c->priorityHold = true;
+            simLog(sim, "Traffic Light %c: Lane A2 priority - %d vehicles remaining\n", junction.signals[prioritySignal].label, laneA2Count);
+            return;
+        }
+
+        // Priority modification: If Lane A2 has between 5 and 10 vehicles, make sure it is next in line
+        if (laneA2Count >= 5) {
+            c->priorityNext = true;
+            simLog(sim, "Lane A2 has medium priority, ensuring it is next in line.\n");
+        }
+    }
+
+    // NORMAL CYCLE with priority scheduling
+    if (c->remaining == 0) {
+        if (c->priorityNext) {
+            c->priorityNext = false; // cycle restarts normally afterwards
+            startGreen(sim, prioritySignal);
+        } else {
+            startGreen(sim, c->cyclePosition);
+            c->cyclePosition = (c->cyclePosition + 1) % junction.signalCount;
+            if (c->cyclePosition == 0) c->cycleStarted = false;
+        }
+    }
+
+    simLog(sim, "Traffic Light %c: %d seconds remaining\n", junction.signals[c->phase].label, c->remaining);
+    c->remaining--;
+}
+
+void refreshTrafficLight(void* arg) {
+    if (junction.signalCount == 0) return;
 
-            for (int j = 0; j < 4; j++) {
-                trafficLights[j].isRed = true;
+    int seconds = 0;
+    TRACE_THREAD("signals");
+    while (running) {
+        lockSimulation();
+        stepSignalController(&simulation);
+        if (++seconds % ADMISSION_REPORT_SEC == 0) {
+            const SimulationStats* stats = &simulation.stats;
+            if (stats->rejected || stats->dropped || stats->deferred || stats->duplicates) {
+                printf("Admission: %lld rejected, %lld dropped, %lld deferred (%d waiting), %lld duplicates, "
+                       "%lld ingest stalls\n",
+                       (long long)stats->rejected, (long long)stats->dropped, (long long)stats->deferred,
+                       simulation.spillCount, (long long)stats->duplicates, (long long)stats->stalls);
             }
-            trafficLights[1].isRed = false; // Force Lane A green
+        }
+        pthread_mutex_unlock(&simLock);
+        sleep(1);
+    }
+}
+
+// ** Checkpoints **
+// Native-endian binary image of the lane queues, lights and controller:
+// header, one byte per light, the controller fields, then per lane a vehicle
+// count followed by (s, v, accel, maxSpeed, waitMs, carry, plate) for each vehicle front
+// to rear, and finally the spill buffer as a count and (lane, plate) per entry.
+
+static void appendBytes(const void* bytes, size_t size) {
+    if (checkpointBuffer.size + size > checkpointBuffer.capacity) {
+        size_t capacity = checkpointBuffer.capacity ? checkpointBuffer.capacity : 4096;
+        while (capacity < checkpointBuffer.size + size) capacity *= 2;
+        checkpointBuffer.data = realloc(checkpointBuffer.data, capacity);
+        checkpointBuffer.capacity = capacity;
+    }
+    memcpy(checkpointBuffer.data + checkpointBuffer.size, bytes, size);
+    checkpointBuffer.size += size;
+}
+
+static void appendInt32(int32_t value) {
+    appendBytes(&value, sizeof(value));
+}
+
+// FNV-1a over the compiled lane and signal tables (zero padded by the loader)
+static uint64_t layoutFingerprint() {
+    uint64_t hash = 14695981039346656037ULL;
+    const uint8_t* tables[2] = {(const uint8_t*)junction.lanes, (const uint8_t*)junction.signals};
+    size_t sizes[2] = {junction.laneCount * sizeof(LanePath), junction.signalCount * sizeof(SignalGroup)};
+    for (int t = 0; t < 2; t++) {
+        for (size_t i = 0; i < sizes[t]; i++) {
+            hash ^= tables[t][i];
+            hash *= 1099511628211ULL;
+        }
+    }
+    return hash;
+}
 
-            while (laneA2Count > 5 && running) { // Keep green until below 5
-                printf("Traffic Light A: Lane A2 priority - %d vehicles remaining\n", laneA2Count);
-                sleep(1);
-                laneA2Count = countVehiclesInQueue(centralLaneQueues[0].front);
+// ** Copy the simulation into the checkpoint buffer (caller holds simLock) **
+void snapshotSimulation(const Simulation* sim) {
+    TRACE_SCOPE("checkpoint snapshot");
+    pthread_mutex_lock(&checkpointLock);
+    if (checkpointPending) {
+        pthread_mutex_unlock(&checkpointLock);
+        printf("Checkpoint skipped: previous one is still being written\n");
+        return;
+    }
+
+    checkpointBuffer.size = 0;
+    CheckpointHeader header = {CHECKPOINT_MAGIC, CHECKPOINT_VERSION, junction.laneCount, junction.signalCount,
+                               sim->tickMs, layoutFingerprint(), sim->tick};
+    appendBytes(&header, sizeof(header));
+    for (int i = 0; i < junction.signalCount; i++) {
+        uint8_t isRed = sim->trafficLights[i].isRed;
+        appendBytes(&isRed, 1);
+    }
+    appendInt32(sim->controller.phase);
+    appendInt32(sim->controller.remaining);
+    appendInt32(sim->controller.cyclePosition);
+    appendInt32(sim->controller.cycleStarted);
+    appendInt32(sim->controller.priorityHold);
+    appendInt32(sim->controller.priorityNext);
+    for (int i = 0; i < junction.laneCount; i++) {
+        appendInt32(sim->laneQueues[i].count);
+        for (LaneVehicle* v = sim->laneQueues[i].front; v; v = v->next) {
+            appendInt32(v->s);
+            appendInt32(v->v);
+            appendInt32(v->accel);
+            appendInt32(v->maxSpeed);
+            appendInt32(v->waitMs);
+            appendInt32(v->carry);
+            appendBytes(&v->plate, sizeof(v->plate));
+        }
+    }
+    appendInt32(sim->spillCount);
+    for (int n = 0; n < sim->spillCount; n++) {
+        appendInt32(sim->spill[(sim->spillHead + n) % MAX_SPILL]);
+        appendBytes(&sim->spillPlates[(sim->spillHead + n) % MAX_SPILL], sizeof(uint64_t));
+    }
+
+    checkpointPending = true;
+    pthread_cond_signal(&checkpointReady);
+    pthread_mutex_unlock(&checkpointLock);
+}
+
+// ** Thread Function to write snapshots without holding up the simulation **
+void* checkpointWriter(void* arg) {
+    (void)arg;
+    char tmpPath[CONFIG_LINE_LENGTH];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", checkpointPath);
+    TRACE_THREAD("checkpoint writer");
+
+    pthread_mutex_lock(&checkpointLock);
+    while (running) {
+        while (!checkpointPending && running) {
+            pthread_cond_wait(&checkpointReady, &checkpointLock);
+        }
+        if (!checkpointPending) break;
+        pthread_mutex_unlock(&checkpointLock);
+
+        // The buffer is ours until checkpointPending is cleared
+        FILE* file = fopen(tmpPath, "wb");
+        if (!file) {
+            perror("Checkpoint open failed");
+        } else {
+            TRACE_SCOPE("checkpoint write");
+            bool ok = fwrite(checkpointBuffer.data, 1, checkpointBuffer.size, file) == checkpointBuffer.size;
+            ok = (fflush(file) == 0) && ok;
+            ok = (fsync(fileno(file)) == 0) && ok;
+            ok = (fclose(file) == 0) && ok;
+            if (ok && rename(tmpPath, checkpointPath) == 0) {
+                printf("Checkpoint written to %s (%zu bytes)\n", checkpointPath, checkpointBuffer.size);
+            } else {
+                perror("Checkpoint write failed");
             }
+        }
+
+        pthread_mutex_lock(&checkpointLock);
+        checkpointPending = false;
+    }
+    pthread_mutex_unlock(&checkpointLock);
+    return NULL;
+}
+
+static bool readInt32(FILE* file, int32_t* value) {
+    return fread(value, sizeof(*value), 1, file) == 1;
+}
+
+// ** Rebuild queues, lights and controller from a checkpoint file **
+bool restoreCheckpoint(Simulation* sim, const char* filePath) {
+    FILE* file = fopen(filePath, "rb");
+    if (!file) {
+        perror(filePath);
+        return false;
+    }
+
+    CheckpointHeader header;
+    const char magic[8] = CHECKPOINT_MAGIC;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, magic, sizeof(magic)) != 0 ||
+        header.version != CHECKPOINT_VERSION) {
+        fprintf(stderr, "%s: not a checkpoint of this simulator version\n", filePath);
+        fclose(file);
+        return false;
+    }
+    if (header.laneCount != (uint32_t)junction.laneCount || header.signalCount != (uint32_t)junction.signalCount ||
+        header.layoutFingerprint != layoutFingerprint()) {
+        fprintf(stderr, "%s: checkpoint was taken with a different junction layout\n", filePath);
+        fclose(file);
+        return false;
+    }
 
-            printf("Lane A2 priority mode ended, resuming normal cycle.\n");
+    bool ok = true;
+    for (int i = 0; ok && i < junction.signalCount; i++) {
+        uint8_t isRed;
+        ok = fread(&isRed, 1, 1, file) == 1;
+        sim->trafficLights[i].isRed = isRed;
+    }
+    int32_t fields[6];
+    for (int i = 0; ok && i < 6; i++) ok = readInt32(file, &fields[i]);
+    // phase and cyclePosition index the lights: out of range they would write past them
+    ok = ok && (fields[0] == -1 || (fields[0] >= 0 && fields[0] < junction.signalCount)) && fields[1] >= 0 &&
+         ((fields[2] >= 0 && fields[2] < junction.signalCount) || (fields[2] == 0 && junction.signalCount == 0));
+    if (ok) {
+        sim->controller.phase = fields[0];
+        sim->controller.remaining = fields[1];
+        sim->controller.cyclePosition = fields[2];
+        sim->controller.cycleStarted = fields[3];
+        sim->controller.priorityHold = fields[4];
+        sim->controller.priorityNext = fields[5];
+    }
+
+    int restored = 0;
+    for (int i = 0; ok && i < junction.laneCount; i++) {
+        int32_t count;
+        ok = readInt32(file, &count) && count >= 0;
+        for (int n = 0; ok && n < count; n++) {
+            int32_t s, v, accel, maxSpeed, waitMs, carry;
+            uint64_t plate;
+            ok = readInt32(file, &s) && readInt32(file, &v) && readInt32(file, &accel) && readInt32(file, &maxSpeed) &&
+                 readInt32(file, &waitMs) && readInt32(file, &carry) && fread(&plate, sizeof(plate), 1, file) == 1 &&
+                 accel > 0 && maxSpeed > 0;
+            if (!ok) break;
+            enqueueLaneVehicle(sim, i, plate);
+            LaneVehicle* vehicle = sim->laneQueues[i].rear;
+            vehicle->s = s;
+            vehicle->v = v;
+            vehicle->accel = accel;
+            vehicle->maxSpeed = maxSpeed;
+            vehicle->waitMs = waitMs;
+            vehicle->carry = carry;
+            placeOnLane(&junction.lanes[i], vehicle);
+            restored++;
         }
+    }
+    int32_t spilled = 0;
+    ok = ok && readInt32(file, &spilled) && spilled >= 0 && spilled <= MAX_SPILL;
+    for (int n = 0; ok && n < spilled; n++) {
+        int32_t lane;
+        uint64_t plate;
+        ok = readInt32(file, &lane) && lane >= 0 && lane < junction.laneCount &&
+             fread(&plate, sizeof(plate), 1, file) == 1;
+        if (!ok) break;
+        if (sim->spillCount >= sim->spillCapacity) {
+            continue;  // more than --spill-capacity allows: dropped, reported below
+        }
+        sim->spill[(sim->spillHead + sim->spillCount) % MAX_SPILL] = lane;
+        sim->spillPlates[(sim->spillHead + sim->spillCount) % MAX_SPILL] = plate;
+        sim->spillCount++;
+        sim->spilledPerLane[lane]++;
+        indexPlate(&sim->plates, plate, lane, NULL);
+    }
+    fclose(file);
+    if (!ok) {
+        fprintf(stderr, "%s: truncated or corrupt checkpoint\n", filePath);
+        return false;
+    }
+    if (spilled > sim->spillCount) {
+        simLog(sim, "Dropped %d spilled vehicles beyond the spill capacity of %d\n", spilled - sim->spillCount,
+               sim->spillCapacity);
+    }
 
-        // Priority modification: If Lane A2 has between 5 and 10 vehicles, make sure it is next in line
-        int priorityLane = -1;
-        if (laneA2Count >= 5 && laneA2Count <= 10) {
-            priorityLane = 1; // Set A2 (trafficLights[1]) to be next
-            printf("Lane A2 has medium priority, ensuring it is next in line.\n");
+    sim->tick = header.tick;
+    memset(&sim->stats, 0, sizeof(sim->stats));  // statistics start at the restore point
+    if (header.tickMs != (uint32_t)sim->tickMs) {
+        simLog(sim, "Checkpoint used a %u ms tick, continuing with %d ms\n", header.tickMs, sim->tickMs);
+    }
+    simLog(sim, "Restored %d vehicles from %s at tick %llu\n", restored, filePath, (unsigned long long)sim->tick);
+    return true;
+}
+
+// ** Scenario sweeps **
+// Headless runs of the same junction under different arrival rates, approach
+// mixes and signal policies, one independent Simulation per scenario and seed.
+
+// scenario <name> rate <veh/s> [weight <road> <w>]... [green <sec>] [priority on|off]
+//          [seeds <n>] [duration <sec>]
+static bool parseScenario(Scenario* scenario) {
+    memset(scenario, 0, sizeof(*scenario));
+    scenario->timePerVehicle = TIME_PER_VEHICLE;
+    scenario->priorityEnabled = true;
+    scenario->seeds = 1;
+    scenario->durationSec = 3600;
+    for (int road = 0; road < MAX_ROADS; road++) {
+        scenario->mix[road] = junction.roadLaneCount[road] > 0 ? 1.0 : 0.0;
+    }
+
+    char* name = strtok(NULL, TOKEN_SEPARATORS);
+    if (!name || strlen(name) >= SCENARIO_NAME_LENGTH) return false;
+    strcpy(scenario->name, name);
+
+    char* key;
+    while ((key = strtok(NULL, TOKEN_SEPARATORS))) {
+        if (strcmp(key, "rate") == 0) {
+            if (!nextDouble(&scenario->rate)) return false;
+        } else if (strcmp(key, "weight") == 0) {
+            char road;
+            double weight;
+            if (!nextChar(&road) || road < 'A' || road > 'Z' || !nextDouble(&weight) || weight < 0) return false;
+            if (weight > 0 && junction.roadLaneCount[road - 'A'] == 0) return false;
+            scenario->mix[road - 'A'] = weight;
+        } else if (strcmp(key, "green") == 0) {
+            if (!nextInt(&scenario->timePerVehicle)) return false;
+        } else if (strcmp(key, "priority") == 0) {
+            char* value = strtok(NULL, TOKEN_SEPARATORS);
+            if (!value || (strcmp(value, "on") != 0 && strcmp(value, "off") != 0)) return false;
+            scenario->priorityEnabled = strcmp(value, "on") == 0;
+        } else if (strcmp(key, "seeds") == 0) {
+            if (!nextInt(&scenario->seeds)) return false;
+        } else if (strcmp(key, "duration") == 0) {
+            if (!nextInt(&scenario->durationSec)) return false;
+        } else {
+            return false;
         }
+    }
 
-        // NORMAL CYCLE with priority scheduling
-        for (int i = 0; i < 4; i++) {
-            int laneIndex = (priorityLane != -1 && i == 0) ? priorityLane : i; // If priority is set, swap first turn
+    double totalWeight = 0;
+    for (int road = 0; road < MAX_ROADS; road++) totalWeight += scenario->mix[road];
+    return scenario->rate > 0 && totalWeight > 0 && scenario->timePerVehicle > 0 &&
+           scenario->seeds > 0 && scenario->durationSec > 0;
+}
 
-            int prev = (laneIndex == 0) ? 3 : laneIndex - 1;
-            trafficLights[prev].isRed = true;
-            trafficLights[laneIndex].isRed = false; // Set current green
+static int loadScenarios(const char* filePath, Scenario* scenarios) {
+    FILE* file = fopen(filePath, "r");
+    if (!file) {
+        perror(filePath);
+        return -1;
+    }
 
-            char light;
-            if (laneIndex == 0) light = 'D';
-            if (laneIndex == 1) light = 'A';
-            if (laneIndex == 2) light = 'C';
-            if (laneIndex == 3) light = 'B';
+    char line[CONFIG_LINE_LENGTH];
+    int lineNumber = 0, count = 0;
+    while (fgets(line, sizeof(line), file)) {
+        lineNumber++;
+        char* hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+
+        char* directive = strtok(line, TOKEN_SEPARATORS);
+        if (!directive) continue;
+        if (strcmp(directive, "scenario") != 0 || count == MAX_SCENARIOS || !parseScenario(&scenarios[count])) {
+            fprintf(stderr, "%s:%d: invalid scenario\n", filePath, lineNumber);
+            fclose(file);
+            return -1;
+        }
+        count++;
+    }
+    fclose(file);
+    return count;
+}
 
-            int vehiclesCount = countVehiclesInQueue(centralLaneQueues[1].front) +
-                                countVehiclesInQueue(centralLaneQueues[3].front) +
-                                countVehiclesInQueue(centralLaneQueues[2].front);
+static double uniformSample(unsigned* rng) {
+    return rand_r(rng) / ((double)RAND_MAX + 1.0);
+}
 
-            int V = (vehiclesCount > 0) ? (vehiclesCount / 3) : 1;
-            if (V < 1) V = 1;
-            int greenTime = V * TIME_PER_VEHICLE;
+// Time to the next Poisson arrival, in ms
+static double arrivalGapMs(unsigned* rng, double rate) {
+    return -log(1.0 - uniformSample(rng)) / rate * 1000.0;
+}
 
-            for (int t = greenTime; t > 0 && running; t--) {
-                printf("Traffic Light %c: %d seconds remaining\n", light, t);
-                sleep(1);
+static int pickArrivalLane(const Scenario* scenario, unsigned* rng) {
+    double totalWeight = 0;
+    for (int road = 0; road < MAX_ROADS; road++) totalWeight += scenario->mix[road];
+
+    double pick = uniformSample(rng) * totalWeight;
+    int road = -1;
+    for (int i = 0; i < MAX_ROADS; i++) {
+        if (scenario->mix[i] <= 0) continue;
+        road = i;  // falls back to the last weighted road on rounding
+        if (pick < scenario->mix[i]) break;
+        pick -= scenario->mix[i];
+    }
+    return junction.roadLanes[road][rand_r(rng) % junction.roadLaneCount[road]];
+}
+
+static void freeSimulation(Simulation* sim) {
+    for (int i = 0; i < junction.laneCount; i++) {
+        LaneVehicle* current = sim->laneQueues[i].front;
+        while (current) {
+            LaneVehicle* next = current->next;
+            free(current);
+            current = next;
+        }
+        sim->laneQueues[i].front = sim->laneQueues[i].rear = NULL;
+    }
+    free(sim->plates.slots);
+    memset(&sim->plates, 0, sizeof(sim->plates));
+}
+
+typedef struct {
+    SweepRun* runs;
+    int runCount;
+    atomic_int nextRun;
+    const Simulation* base;  // tick length and admission settings for every run
+    const char* restorePath;
+} SweepQueue;
+
+// Empty simulation with the base settings and the scenario's signal policy
+static void emptyRun(Simulation* sim, const SweepRun* run, const SweepQueue* queue) {
+    *sim = *queue->base;
+    resetSignalController(sim);
+    sim->timePerVehicle = run->scenario->timePerVehicle;
+    sim->priorityEnabled = run->scenario->priorityEnabled;
+    sim->analytics.run = (uint32_t)(run - queue->runs) + 1;
+}
+
+// ** Run one scenario/seed as fast as possible in simulated time **
+static void runScenario(SweepRun* run, const SweepQueue* queue) {
+    const Scenario* scenario = run->scenario;
+    Simulation* sim = malloc(sizeof(Simulation));
+    emptyRun(sim, run, queue);
+    if (queue->restorePath && !restoreCheckpoint(sim, queue->restorePath)) {
+        fprintf(stderr, "Scenario %s seed %u: restore failed, starting empty\n", scenario->name, run->seed);
+        freeSimulation(sim);  // vehicles restored before the failure
+        emptyRun(sim, run, queue);
+    }
+
+    unsigned rng = run->seed;
+    double nowMs = 0;
+    double nextArrivalMs = arrivalGapMs(&rng, scenario->rate);
+    int signalMs = 1000;  // the controller steps at t=0 like the light thread
+    uint64_t ticks = (uint64_t)scenario->durationSec * 1000 / sim->tickMs;
+    int queued = 0;  // stopped vehicles after the last tick
+
+    for (uint64_t t = 0; t < ticks; t++) {
+        while (signalMs >= 1000) {
+            stepSignalController(sim);
+            sim->stats.queueSamples++;
+            sim->stats.queueTotal += queued;
+            if (queued > sim->stats.queueMax) sim->stats.queueMax = queued;
+            signalMs -= 1000;
+        }
+        while (nextArrivalMs <= nowMs) {
+            if (admitVehicle(sim, pickArrivalLane(scenario, &rng), 0) == ADMIT_SPILL_FULL) {
+                sim->stats.rejected++;  // no upstream to hold it back in a sweep
             }
+            nextArrivalMs += arrivalGapMs(&rng, scenario->rate);
+        }
+
+        queued = updateLaneVehiclePositions(sim, sim->tickMs);
+        sim->tick++;
+        nowMs += sim->tickMs;
+        signalMs += sim->tickMs;
+    }
+
+    const SimulationStats* stats = &sim->stats;
+    run->throughput = stats->departures * 3600.0 / scenario->durationSec;
+    run->meanQueue = stats->queueSamples ? (double)stats->queueTotal / stats->queueSamples : 0;
+    run->maxQueue = stats->queueMax;
+    run->meanWait = stats->departures ? stats->waitMs / 1000.0 / stats->departures : 0;
+    run->lost = stats->rejected + stats->dropped;
+
+    flushAnalytics(sim);  // the run may end part way through a window
+    freeSimulation(sim);
+    free(sim);
+}
+
+static void* sweepWorker(void* arg) {
+    SweepQueue* queue = (SweepQueue*)arg;
+    int i;
+    while ((i = atomic_fetch_add(&queue->nextRun, 1)) < queue->runCount) {
+        runScenario(&queue->runs[i], queue);
+    }
+    return NULL;
+}
+
+// ** Run every scenario of a sweep file on a pool of threads and print the results table **
+int runSweep(const char* sweepFile, int jobs, const Simulation* base, const char* restorePath, const char* resultsPath) {
+    static Scenario scenarios[MAX_SCENARIOS];
+    int scenarioCount = loadScenarios(sweepFile, scenarios);
+    if (scenarioCount <= 0) {
+        if (scenarioCount == 0) fprintf(stderr, "%s: no scenarios\n", sweepFile);
+        return -1;
+    }
 
-            // Reset priority after execution
-            if (priorityLane != -1) {
-                priorityLane = -1;
-                i = -1; // Restart cycle normally
+    int runCount = 0;
+    for (int i = 0; i < scenarioCount; i++) runCount += scenarios[i].seeds;
+    if (runCount > MAX_SWEEP_RUNS) {
+        fprintf(stderr, "%s: %d runs, at most %d allowed\n", sweepFile, runCount, MAX_SWEEP_RUNS);
+        return -1;
+    }
+
+    SweepQueue queue = {calloc(runCount, sizeof(SweepRun)), runCount, 0, base, restorePath};
+    int n = 0;
+    for (int i = 0; i < scenarioCount; i++) {
+        for (int seed = 1; seed <= scenarios[i].seeds; seed++) {  // same seeds in every scenario
+            queue.runs[n].scenario = &scenarios[i];
+            queue.runs[n].seed = seed;
+            n++;
+        }
+    }
+
+    if (jobs > runCount) jobs = runCount;
+    printf("Running %d scenarios (%d runs) on %d threads\n", scenarioCount, runCount, jobs);
+    pthread_t* workers = malloc(jobs * sizeof(pthread_t));
+    for (int i = 0; i < jobs; i++) pthread_create(&workers[i], NULL, sweepWorker, &queue);
+    for (int i = 0; i < jobs; i++) pthread_join(workers[i], NULL);
+    free(workers);
+
+    if (resultsPath) {
+        FILE* file = fopen(resultsPath, "w");
+        if (!file) {
+            perror(resultsPath);
+        } else {
+            fprintf(file, "scenario,seed,throughput_veh_h,mean_queue,max_queue,mean_wait_s,lost\n");
+            for (int i = 0; i < runCount; i++) {
+                const SweepRun* run = &queue.runs[i];
+                fprintf(file, "%s,%u,%.1f,%.2f,%d,%.2f,%lld\n", run->scenario->name, run->seed,
+                        run->throughput, run->meanQueue, run->maxQueue, run->meanWait, (long long)run->lost);
             }
+            fclose(file);
+        }
+    }
+
+    printf("%-*s %5s %10s %8s %10s %9s %8s %8s\n", SCENARIO_NAME_LENGTH, "scenario", "runs",
+           "veh/h", "+/-", "queue avg", "queue max", "wait s", "lost");
+    n = 0;
+    for (int i = 0; i < scenarioCount; i++) {
+        const SweepRun* runs = &queue.runs[n];
+        int seeds = scenarios[i].seeds;
+        double throughput = 0, queueAvg = 0, wait = 0, spread = 0;
+        int queueMax = 0;
+        int64_t lost = 0;
+        for (int k = 0; k < seeds; k++) {
+            lost += runs[k].lost;
+            throughput += runs[k].throughput / seeds;
+            queueAvg += runs[k].meanQueue / seeds;
+            wait += runs[k].meanWait / seeds;
+            if (runs[k].maxQueue > queueMax) queueMax = runs[k].maxQueue;
+        }
+        for (int k = 0; k < seeds; k++) {
+            spread += (runs[k].throughput - throughput) * (runs[k].throughput - throughput);
+        }
+        spread = seeds > 1 ? sqrt(spread / (seeds - 1)) : 0;
+        printf("%-*s %5d %10.1f %8.1f %10.2f %9d %8.2f %8lld\n", SCENARIO_NAME_LENGTH, scenarios[i].name, seeds,
+               throughput, spread, queueAvg, queueMax, wait, (long long)lost);
+        n += seeds;
+    }
+
+    free(queue.runs);
+    return 0;
+}
+
+// Pick one of the approach's lanes at random, -1 if the road has none
+static int pickRoadLane(char lane) {
+    if (lane < 'A' || lane > 'Z') return -1;
+    int road = lane - 'A';
+    if (junction.roadLaneCount[road] == 0) return -1;
+    return junction.roadLanes[road][rand() % junction.roadLaneCount[road]];
+}
+
+// With the spill policy this blocks while the spill buffer is full; LaneControl
+// then stops reading, so the transport pushes back on the receiver.
+// Caller holds simLock.
+static AdmitResult admitOrWait(int laneIndex, uint64_t plate) {
+    AdmitResult result;
+    bool stalled = false;
+    while ((result = admitVehicle(&simulation, laneIndex, plate)) == ADMIT_SPILL_FULL && running) {
+        if (!stalled) simulation.stats.stalls++;
+        stalled = true;
+        pthread_cond_wait(&admissionSpace, &simLock);
+    }
+    return result;
+}
+
+// ** Admit one arriving vehicle on a random lane of its approach **
+// verbose prints the outcome; refusals are counted in the stats either way.
+static void ingestVehicle(const char* vehicleID, char lane, bool verbose) {
+    TRACE_SCOPE("ingest vehicle");
+    int laneIndex = pickRoadLane(lane);
+    if (laneIndex < 0) return;
+    const LanePath* path = &junction.lanes[laneIndex];
+    uint64_t plate = packPlate(vehicleID, strlen(vehicleID));
+
+    // A resend of a vehicle still in the junction is dropped
+    lockSimulation();
+    if (findPlate(&simulation.plates, plate)) {
+        simulation.stats.duplicates++;
+        pthread_mutex_unlock(&simLock);
+        if (verbose) printf("Duplicate vehicle %s ignored\n", vehicleID);
+        return;
+    }
+    AdmitResult result = admitOrWait(laneIndex, plate);
+    pthread_mutex_unlock(&simLock);
+    if (!verbose) return;
+
+    const char* kind = path->kind == LANE_FREE ? "free" : "central";
+    switch (result) {
+        case ADMIT_OK:
+        case ADMIT_DROPPED_OLDEST:
+            printf("Enqueued %svehicle %s at x=%d, y=%d, lane=%c\n", kind, vehicleID, path->spawnX, path->spawnY, lane);
+            break;
+        case ADMIT_SPILLED:
+            printf("Deferred %svehicle %s, lane %c is full\n", kind, vehicleID, lane);
+            break;
+        default:
+            printf("Rejected %svehicle %s, lane %c is full\n", kind, vehicleID, lane);
+            break;
+    }
+}
+
+// ** Parse one "PLATE:LANE" record **
+static void handleVehicleRecord(const char* record) {
+    printf("Simulator received: %s\n", record);
+
+    // Parse vehicle data
+    char vehicleID[10];
+    char lane;
+    if (sscanf(record, "%9[^:]:%c", vehicleID, &lane) != 2) return;
+    ingestVehicle(vehicleID, lane, true);
+}
+
+// ** Shared-memory ingest: drain the ring filled by ./receiver --shm **
+// Records are not logged one by one, which would cost more than the ring saves.
+static void consumeVehicleRing() {
+    VehicleRing* ring = vehicleRingOpen(VEHICLE_RING_NAME);
+    if (!ring) exit(EXIT_FAILURE);
+    printf("Simulator reading shared-memory ring %s...\n", VEHICLE_RING_NAME);
+
+    VehicleRecord record;
+    char vehicleID[PLATE_LENGTH + 1];
+    while (running) {
+        if (!vehicleRingPop(ring, &record)) continue;
+        memcpy(vehicleID, record.plate, PLATE_LENGTH);
+        vehicleID[PLATE_LENGTH] = '\0';
+        ingestVehicle(vehicleID, record.lane, false);
+    }
+    munmap(ring, sizeof(VehicleRing));
+}
+
+// ** Admit every record of a datagram under one lock, without per-vehicle logs **
+// UDP has no flow control to push back with, so a full spill buffer rejects
+// instead of blocking the socket drain.
+static void ingestDatagram(const VehicleDatagram* datagram) {
+    TRACE_SCOPE("ingest datagram");
+    lockSimulation();
+    for (int i = 0; i < datagram->header.count; i++) {
+        int laneIndex = pickRoadLane(datagram->records[i].lane);
+        if (laneIndex < 0) continue;
+        uint64_t plate = packPlate(datagram->records[i].plate, PLATE_LENGTH);
+        if (findPlate(&simulation.plates, plate)) {
+            simulation.stats.duplicates++;
+        } else if (admitVehicle(&simulation, laneIndex, plate) == ADMIT_SPILL_FULL) {
+            simulation.stats.rejected++;
         }
     }
+    pthread_mutex_unlock(&simLock);
+}
+
+// ** UDP ingest: drain batches of datagrams sent by ./receiver --udp **
+// Datagrams keep the generator's source id and sequence number through the
+// receiver, so the loss counted here is end to end.
+static void consumeVehicleDatagrams() {
+    static VehicleDatagram datagrams[UDP_BATCH];
+    struct mmsghdr messages[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    DatagramLoss loss = {0};
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        perror("Socket failed");
+        exit(EXIT_FAILURE);
+    }
+    int size = UDP_RECEIVE_BUFFER;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    struct timeval wake = {1, 0};  // re-check running while idle
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &wake, sizeof(wake));
+
+    struct sockaddr_in server_addr = {0};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(simulatorPort);
+    if (bind(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Bind failed");
+        close(sock);
+        exit(EXIT_FAILURE);
+    }
+
+    memset(messages, 0, sizeof(messages));
+    for (int i = 0; i < UDP_BATCH; i++) {
+        iov[i].iov_base = &datagrams[i];
+        iov[i].iov_len = sizeof(VehicleDatagram);
+        messages[i].msg_hdr.msg_iov = &iov[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+    printf("Simulator listening for datagrams on UDP port %d...\n", simulatorPort);
+
+    time_t nextReport = time(NULL) + ADMISSION_REPORT_SEC;
+    while (running) {
+        int received = recvmmsg(sock, messages, UDP_BATCH, MSG_WAITFORONE, NULL);
+        if (received < 0 && errno != EAGAIN && errno != EINTR) perror("Receive failed");
+        for (int i = 0; i < received; i++) {
+            if (trackDatagram(&loss, &datagrams[i], messages[i].msg_len)) ingestDatagram(&datagrams[i]);
+        }
+
+        if (time(NULL) >= nextReport) {
+            nextReport = time(NULL) + ADMISSION_REPORT_SEC;
+            printf("UDP: %llu records in %llu datagrams from %d sources, %llu datagrams lost, %llu late\n",
+                   (unsigned long long)loss.records, (unsigned long long)loss.datagrams, loss.sources,
+                   (unsigned long long)loss.lost, (unsigned long long)loss.late);
+        }
+    }
+    close(sock);
 }
 
 void *LaneControl(void *arg) {
+    TRACE_THREAD("ingest");
+    configureThread("ingest", ingestCpu);
+    if (useShmTransport) {
+        consumeVehicleRing();
+        return NULL;
+    }
+    if (useUdpTransport) {
+        consumeVehicleDatagrams();
+        return NULL;
+    }
+
     int server_fd, client_socket;
     struct sockaddr_in server_addr, client_addr;
     int addrlen = sizeof(client_addr);
     char buffer[BUFFER_SIZE];
+    int buffered = 0;  // bytes of an incomplete record carried over between reads
 
     // Create socket
     if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
@@ -485,7 +1989,7 @@ void *LaneControl(void *arg) {
     // Bind socket
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(SIMULATOR_PORT);
+    server_addr.sin_port = htons(simulatorPort);
 
     if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
         perror("Bind failed");
@@ -500,7 +2004,7 @@ void *LaneControl(void *arg) {
         exit(EXIT_FAILURE);
     }
 
-    printf("Simulator listening on port %d...\n", SIMULATOR_PORT);
+    printf("Simulator listening on port %d...\n", simulatorPort);
 
     while (1) {
         client_socket = accept(server_fd, (struct sockaddr*)&client_addr, (socklen_t*)&addrlen);
@@ -509,131 +2013,247 @@ void *LaneControl(void *arg) {
             continue;
         }
 
+        buffered = 0;
         while (1) {
-            int bytes_read = read(client_socket, buffer, BUFFER_SIZE);
+            int bytes_read = read(client_socket, buffer + buffered, BUFFER_SIZE - 1 - buffered);
             if (bytes_read <= 0) {
                 printf("Client disconnected.\n");
                 close(client_socket);
                 break;
             }
-
-            buffer[bytes_read] = '\0';
-            printf("Simulator received: %s\n", buffer);
-
-            // Parse vehicle data
-            char vehicleID[10];
-            char lane;
-            if (sscanf(buffer, "%9[^:]:%c", vehicleID, &lane) != 2) continue;
-
-            int x = 0, y = 0, laneNumber=0;
-            switch (lane) {
-                case 'D': 
-                if (rand()%2){
-                    x = 0; y = WINDOW_HEIGHT/2 - ROAD_WIDTH/4 - VEHICLE_HEIGHT - 13;
-                    laneNumber=3;//free lane
-                }else{
-                    x = 0; y = WINDOW_HEIGHT/2  - VEHICLE_HEIGHT - 13;
-                    laneNumber=2;//central lane
-                }break;
-
-                case 'A': 
-                if (rand()%2){
-                    x = WINDOW_WIDTH/2 + ROAD_WIDTH/4 + 13; y = 0; 
-                    laneNumber=3;//free lane
-                }else{
-                    x = WINDOW_WIDTH/2 + 13; y = 0; 
-                    laneNumber=2;//central lane
-                }break;
-
-                case 'C': 
-                if (rand()%2){
-                    x = WINDOW_WIDTH - VEHICLE_WIDTH; y = WINDOW_HEIGHT/2 + ROAD_WIDTH/4 + 13; 
-                    laneNumber=3;//free lane
-                }else{
-                    x = WINDOW_WIDTH - VEHICLE_WIDTH; y = WINDOW_HEIGHT/2 + 13; 
-                    laneNumber=2;//central lane
-                }break;
-
-                case 'B':  
-                if (rand()%2){
-                    x = WINDOW_WIDTH/2 - ROAD_WIDTH/4 - VEHICLE_HEIGHT - 13; y = WINDOW_HEIGHT - VEHICLE_WIDTH;
-                    laneNumber=3;//free lane
-                }else{
-                    x = WINDOW_WIDTH/2 - VEHICLE_HEIGHT - 13; y = WINDOW_HEIGHT - VEHICLE_WIDTH;
-                    laneNumber=2;//central lane
-                }break;
-
-                default: continue;
-            }
-
-            //printf("Enqueuing vehicle %s at x=%d, y=%d, lane=%c, laneNumber=%d\n", vehicleID, x, y, lane, laneNumber);
-            
-            if(laneNumber==3){enqueueFreeLaneVehicle(x, y, FREE_VEHICLE_SPEED, lane);
-            printf("Enqueued freevehicle %s at x=%d, y=%d, lane=%c, laneNumber=%d\n", vehicleID, x, y, lane, laneNumber);
-            }
-            if(laneNumber==2){enqueueCentralLaneVehicle(x, y, CENTRAL_VEHICLE_SPEED, lane);
-            printf("Enqueued centralvehicle %s at x=%d, y=%d, lane=%c, laneNumber=%d\n", vehicleID, x, y, lane, laneNumber);
+            buffered += bytes_read;
+            buffer[buffered] = '\0';
+
+            // Records are newline terminated, a read may hold several or a partial one
+            char* record = buffer;
+            char* newline;
+            while ((newline = strchr(record, '\n'))) {
+                *newline = '\0';
+                handleVehicleRecord(record);
+                record = newline + 1;
             }
+            buffered = strlen(record);
+            if (buffered == BUFFER_SIZE - 1) buffered = 0;  // no newline in a full buffer: discard it
+            memmove(buffer, record, buffered);
         }
     }
     shutdown(server_fd, SHUT_RDWR); 
     close(server_fd);
 }
 
-void drawTrafficLights(SDL_Renderer *renderer){
-    // draw light box
-    //the traffic box
-    int lightX[4]= {WINDOW_WIDTH/2+ROAD_WIDTH/2, WINDOW_WIDTH/2+ROAD_WIDTH/2-BOX_WIDTH, WINDOW_WIDTH/2-ROAD_WIDTH/2-BOX_WIDTH, WINDOW_WIDTH/2-ROAD_WIDTH/2};
-    int boxX[4]= {WINDOW_WIDTH/2+ROAD_WIDTH/2+BOX_HEIGHT, WINDOW_WIDTH/2+ROAD_WIDTH/2-BOX_WIDTH, WINDOW_WIDTH/2-ROAD_WIDTH/2-BOX_WIDTH-BOX_WIDTH,WINDOW_WIDTH/2-ROAD_WIDTH/2};
-    int boxY[4]= {WINDOW_HEIGHT/2-ROAD_WIDTH/2, WINDOW_HEIGHT/2+ROAD_WIDTH/2+BOX_HEIGHT, WINDOW_HEIGHT/2+ROAD_WIDTH/2-BOX_HEIGHT, WINDOW_HEIGHT/2-ROAD_WIDTH/2-BOX_HEIGHT-BOX_HEIGHT};
-    int lightY[4]= {WINDOW_HEIGHT/2-ROAD_WIDTH/2, WINDOW_HEIGHT/2+ROAD_WIDTH/2, WINDOW_HEIGHT/2+ROAD_WIDTH/2-BOX_HEIGHT, WINDOW_HEIGHT/2-ROAD_WIDTH/2-BOX_HEIGHT};
-    
-    //the lights
-    
+// ** Answer one control command into reply **
+// where <plate>   lane and position of a vehicle, O(1) through the plate index
+static void answerControlCommand(char* command, char* reply, size_t size) {
+    char* verb = strtok(command, TOKEN_SEPARATORS);
+    char* argument = strtok(NULL, TOKEN_SEPARATORS);
+    if (!verb || strcmp(verb, "where") != 0 || !argument) {
+        snprintf(reply, size, "error: usage: where <plate>\n");
+        return;
+    }
 
-    int lightrX[4]={WINDOW_WIDTH/2+ROAD_WIDTH/2+BOX_HEIGHT/2-LIGHT_HEIGHT/2, WINDOW_WIDTH/2+ROAD_WIDTH/2-BOX_WIDTH +BOX_HEIGHT/2-LIGHT_HEIGHT/2, WINDOW_WIDTH/2-ROAD_WIDTH/2-BOX_WIDTH+BOX_HEIGHT/2-LIGHT_HEIGHT/2, WINDOW_WIDTH/2-ROAD_WIDTH/2+BOX_HEIGHT/2-LIGHT_HEIGHT/2};
-    int lightgX[4]= {WINDOW_WIDTH/2+ROAD_WIDTH/2+BOX_HEIGHT+BOX_HEIGHT/2-LIGHT_HEIGHT/2, WINDOW_WIDTH/2+ROAD_WIDTH/2-BOX_WIDTH+BOX_HEIGHT/2-LIGHT_HEIGHT/2, WINDOW_WIDTH/2-ROAD_WIDTH/2-BOX_WIDTH-BOX_WIDTH+BOX_HEIGHT/2-LIGHT_HEIGHT/2,WINDOW_WIDTH/2-ROAD_WIDTH/2+BOX_HEIGHT/2-LIGHT_HEIGHT/2};
-    int lightgY[4]= {WINDOW_HEIGHT/2-ROAD_WIDTH/2+BOX_HEIGHT/2-LIGHT_HEIGHT/2, WINDOW_HEIGHT/2+ROAD_WIDTH/2+BOX_HEIGHT+BOX_HEIGHT/2-LIGHT_HEIGHT/2, WINDOW_HEIGHT/2+ROAD_WIDTH/2-BOX_HEIGHT+BOX_HEIGHT/2-LIGHT_HEIGHT/2, WINDOW_HEIGHT/2-ROAD_WIDTH/2-BOX_HEIGHT-BOX_HEIGHT+BOX_HEIGHT/2-LIGHT_HEIGHT/2};
-    int lightrY[4]= {WINDOW_HEIGHT/2-ROAD_WIDTH/2+BOX_HEIGHT/2-LIGHT_HEIGHT/2, WINDOW_HEIGHT/2+ROAD_WIDTH/2+BOX_HEIGHT/2-LIGHT_HEIGHT/2, WINDOW_HEIGHT/2+ROAD_WIDTH/2-BOX_HEIGHT+BOX_HEIGHT/2-LIGHT_HEIGHT/2, WINDOW_HEIGHT/2-ROAD_WIDTH/2-BOX_HEIGHT+BOX_HEIGHT/2-LIGHT_HEIGHT/2};
+    uint64_t key = packPlate(argument, strlen(argument));
+    char plate[PLATE_LENGTH + 1];
+    unpackPlate(key, plate);
+    pthread_mutex_lock(&simLock);
+    const PlateSlot* slot = findPlate(&simulation.plates, key);
+    if (!slot) {
+        snprintf(reply, size, "%s not found\n", plate);
+    } else {
+        const LanePath* path = &junction.lanes[slot->lane];
+        const char* kind = path->kind == LANE_FREE ? "free" : "central";
+        const LaneVehicle* v = slot->vehicle;
+        if (!v) {
+            snprintf(reply, size, "%s spilled, waiting for lane %c %s\n", plate, path->road, kind);
+        } else {
+            snprintf(reply, size, "%s lane %c %s at x=%d, y=%d, s=%d, speed=%d px/s, stopped %.1f s\n", plate,
+                     path->road, kind, v->x, v->y, FROM_FIXED(v->s), FROM_FIXED(v->v), v->waitMs / 1000.0);
+        }
+    }
+    pthread_mutex_unlock(&simLock);
+}
 
-    
-    for(int i=0; i<4; i++){
+// ** Thread Function serving line-based queries on simulatorPort + 1, one client at a time **
+void *ControlServer(void *arg) {
+    (void)arg;
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_fd < 0) {
+        perror("Control socket failed");
+        return NULL;
+    }
+    int opt = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in server_addr = {0};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server_addr.sin_port = htons(simulatorPort + 1);
+    if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0 || listen(server_fd, 3) < 0) {
+        perror("Control bind failed");
+        close(server_fd);
+        return NULL;
+    }
+    printf("Control commands on port %d\n", simulatorPort + 1);
+
+    char buffer[BUFFER_SIZE];
+    char reply[2 * BUFFER_SIZE];
+    while (running) {
+        int client_socket = accept(server_fd, NULL, NULL);
+        if (client_socket < 0) continue;
+
+        int buffered = 0;
+        int bytes_read;
+        while ((bytes_read = read(client_socket, buffer + buffered, BUFFER_SIZE - 1 - buffered)) > 0) {
+            buffered += bytes_read;
+            buffer[buffered] = '\0';
+
+            char* command = buffer;
+            char* newline;
+            while ((newline = strchr(command, '\n'))) {
+                *newline = '\0';
+                answerControlCommand(command, reply, sizeof(reply));
+                if (send(client_socket, reply, strlen(reply), MSG_NOSIGNAL) < 0) break;
+                command = newline + 1;
+            }
+            buffered = strlen(command);
+            if (buffered == BUFFER_SIZE - 1) buffered = 0;  // no newline in a full buffer: discard it
+            memmove(buffer, command, buffered);
+        }
+        close(client_socket);
+    }
+    close(server_fd);
+    return NULL;
+}
+
+void drawTrafficLights(SDL_Renderer *renderer){
+    for(int i=0; i<junction.signalCount; i++){
+        const SignalGroup* group = &junction.signals[i];
 
         SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);  // Black
-        SDL_Rect lightBox1 = {lightX[i], lightY[i], BOX_WIDTH, BOX_HEIGHT};
-        SDL_Rect lightBox2 = {boxX[i], boxY[i], BOX_HEIGHT, BOX_WIDTH};
-        SDL_RenderFillRect(renderer, &lightBox1);
-        SDL_RenderFillRect(renderer, &lightBox2);
-
-    SDL_Rect light1={lightrX[i], lightrY[i], LIGHT_WIDTH, LIGHT_HEIGHT}; 
-    SDL_Rect light2={lightgX[i], lightgY[i], LIGHT_WIDTH, LIGHT_HEIGHT};
-    SDL_SetRenderDrawColor(renderer, 0, 51, 0, 255);  // Green
- 
-    SDL_RenderFillRect(renderer, &light1);
-    SDL_SetRenderDrawColor(renderer, 51, 0, 0, 255);  // Red
-    SDL_RenderFillRect(renderer, &light2);
-
-         
-    if (trafficLights[i].isRed) {
-        SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);  // Red
-        SDL_RenderFillRect(renderer, &light2);
-    } else {
-        SDL_SetRenderDrawColor(renderer, 0, 255, 0, 255);  // Green
-        SDL_RenderFillRect(renderer, &light1);
+        SDL_RenderFillRect(renderer, &group->greenBox);
+        SDL_RenderFillRect(renderer, &group->redBox);
+
+        SDL_SetRenderDrawColor(renderer, 0, 51, 0, 255);  // Green
+        SDL_RenderFillRect(renderer, &group->greenLamp);
+        SDL_SetRenderDrawColor(renderer, 51, 0, 0, 255);  // Red
+        SDL_RenderFillRect(renderer, &group->redLamp);
+
+        if (simulation.trafficLights[i].isRed) {
+            SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);  // Red
+            SDL_RenderFillRect(renderer, &group->redLamp);
+        } else {
+            SDL_SetRenderDrawColor(renderer, 0, 255, 0, 255);  // Green
+            SDL_RenderFillRect(renderer, &group->greenLamp);
+        }
     }
-    
-   
-    };
-    
 }
 
 
-int main() {
+int main(int argc, char* argv[]) {
    // pthread_t tQueue, tReadFile;
     SDL_Window* window = NULL;
     SDL_Renderer* renderer = NULL;    
     SDL_Event event;    
 
+    const char* junctionFile = JUNCTION_CONFIG;
+    const char* restorePath = NULL;
+    const char* sweepFile = NULL;
+    const char* resultsPath = NULL;
+    const char* tracePath = NULL;
+    const char* analyticsPath = NULL;
+    int analyticsWindowSec = ANALYTICS_WINDOW_SEC;
+    int jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    initSimulation(&simulation);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--junction") == 0 && i + 1 < argc) {
+            junctionFile = argv[++i];
+        } else if (strcmp(argv[i], "--tick-ms") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            simulation.tickMs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lane-capacity") == 0 && i + 1 < argc && atoi(argv[i + 1]) >= 0) {
+            simulation.laneCapacity = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--overflow") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "reject") == 0) simulation.overflow = OVERFLOW_REJECT;
+            else if (strcmp(argv[i], "drop-oldest") == 0) simulation.overflow = OVERFLOW_DROP_OLDEST;
+            else if (strcmp(argv[i], "spill") == 0) simulation.overflow = OVERFLOW_SPILL;
+            else {
+                fprintf(stderr, "Unknown overflow policy %s\n", argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--spill-capacity") == 0 && i + 1 < argc &&
+                   atoi(argv[i + 1]) >= 0 && atoi(argv[i + 1]) <= MAX_SPILL) {
+            simulation.spillCapacity = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            checkpointPath = argv[++i];
+        } else if (strcmp(argv[i], "--checkpoint-every") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            checkpointEverySec = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+            restorePath = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (strcmp(argv[i], "--update-cpu") == 0 && i + 1 < argc && atoi(argv[i + 1]) >= 0) {
+            updateCpu = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ingest-cpu") == 0 && i + 1 < argc && atoi(argv[i + 1]) >= 0) {
+            ingestCpu = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--fifo") == 0 && i + 1 < argc &&
+                   atoi(argv[i + 1]) >= sched_get_priority_min(SCHED_FIFO) &&
+                   atoi(argv[i + 1]) <= sched_get_priority_max(SCHED_FIFO)) {
+            fifoPriority = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--analytics") == 0 && i + 1 < argc) {
+            analyticsPath = argv[++i];
+        } else if (strcmp(argv[i], "--analytics-window") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            analyticsWindowSec = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lod-density") == 0 && i + 1 < argc && atoi(argv[i + 1]) >= 0) {
+            lodDensity = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0 &&
+                   atoi(argv[i + 1]) < 65535) {
+            simulatorPort = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--shm") == 0) {
+            useShmTransport = true;
+        } else if (strcmp(argv[i], "--udp") == 0) {
+            useUdpTransport = true;
+        } else if (strcmp(argv[i], "--sweep") == 0 && i + 1 < argc) {
+            sweepFile = argv[++i];
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            jobs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--results") == 0 && i + 1 < argc) {
+            resultsPath = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--junction FILE] [--tick-ms N] [--restore FILE] [--port N] [--shm | --udp]\n"
+                            "          [--lane-capacity N] [--overflow reject|drop-oldest|spill] [--spill-capacity N]\n"
+                            "          [--checkpoint FILE] [--checkpoint-every SEC] [--lod-density N]\n"
+                            "          [--update-cpu N] [--ingest-cpu N] [--fifo PRIORITY] [--trace FILE]\n"
+                            "          [--analytics FILE [--analytics-window SEC]]\n"
+                            "          [--sweep FILE [--jobs N] [--results FILE]]\n", argv[0]);
+            return -1;
+        }
+    }
+#ifndef ENABLE_TRACE
+    if (tracePath) fprintf(stderr, "Built without -DENABLE_TRACE, --trace is ignored\n");
+#endif
+    if (useShmTransport && useUdpTransport) {
+        fprintf(stderr, "--shm and --udp are alternative transports\n");
+        return -1;
+    }
+    if (!loadJunctionLayout(junctionFile, &junction)) {
+        return -1;
+    }
+    resetSignalController(&simulation);  // the lights only exist once the layout is loaded
+    if (analyticsPath) {
+        if (!openAnalytics(analyticsPath)) return -1;
+        simulation.analytics.windowTicks = analyticsWindowSec * 1000 / simulation.tickMs;
+        if (simulation.analytics.windowTicks == 0) simulation.analytics.windowTicks = 1;
+    }
+    if (sweepFile) {
+        return runSweep(sweepFile, jobs > 0 ? jobs : 1, &simulation, restorePath, resultsPath);
+    }
+
+    simulation.verbose = true;
+    simulation.heatmap = true;
+    if (restorePath && !restoreCheckpoint(&simulation, restorePath)) {
+        return -1;
+    }
+    nextCheckpointTick = simulation.tick + (uint64_t)checkpointEverySec * 1000 / simulation.tickMs;
+
     if (!initializeSDL(&window, &renderer)) {
         return -1;
     }
@@ -645,12 +2265,16 @@ int main() {
 
     //SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
     
-    pthread_t vehicleThread, LaneThread, trafficLightThread;
+    pthread_t vehicleThread, LaneThread, trafficLightThread, checkpointThread, controlThread;
+    if (checkpointPath) {
+        pthread_create(&checkpointThread, NULL, checkpointWriter, NULL);
+    }
     pthread_create(&trafficLightThread, NULL, refreshTrafficLight, NULL);
     pthread_create(&LaneThread, NULL, LaneControl, NULL);
+    pthread_create(&controlThread, NULL, ControlServer, NULL);
     pthread_create(&vehicleThread, NULL, updateVehicles, (void*)renderer);
   
-    bool running = true;
+    TRACE_THREAD("render");
     while (running) {
         // update light
        // refreshLight(renderer, &sharedData);
@@ -659,19 +2283,37 @@ int main() {
            SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255); // Black color
            SDL_RenderClear(renderer);
            drawRoadsAndLane(renderer, NULL);
+           lockSimulation();
            drawTrafficLights(renderer);
-           drawFreeLaneVehicles(renderer);
-           drawCentralLaneVehicles(renderer);
-           SDL_RenderPresent(renderer);
+           drawLaneVehicles(renderer);
+           pthread_mutex_unlock(&simLock);
+           {
+               TRACE_SCOPE("present");
+               SDL_RenderPresent(renderer);
+           }
            SDL_Delay(16);  
     }
     //SDL_DestroyMutex(mutex);
-   
+
+    // Wake the threads waiting on running, and stop the clock before the
+    // last window and the trace are written. The TCP ingest and control
+    // threads block in accept() and read(), and end with the process.
+    lockSimulation();
+    pthread_cond_broadcast(&admissionSpace);
+    pthread_mutex_unlock(&simLock);
+    pthread_mutex_lock(&checkpointLock);
+    pthread_cond_signal(&checkpointReady);
+    pthread_mutex_unlock(&checkpointLock);
+
     pthread_join(vehicleThread, NULL);
-   
-   pthread_join(trafficLightThread, NULL);
-    
-    pthread_join(LaneThread, NULL);
+    pthread_join(trafficLightThread, NULL);
+    if (checkpointPath) pthread_join(checkpointThread, NULL);
+    if (useShmTransport || useUdpTransport) pthread_join(LaneThread, NULL);
+
+    lockSimulation();
+    flushAnalytics(&simulation);
+    pthread_mutex_unlock(&simLock);
+    if (tracePath) TRACE_WRITE(tracePath);
     if (renderer) SDL_DestroyRenderer(renderer);
     if (window) SDL_DestroyWindow(window);
     // pthread_kil
@@ -719,96 +2361,96 @@ void drawRoadsAndLane(SDL_Renderer *renderer, TTF_Font *font) {
     SDL_SetRenderDrawColor(renderer, 192,192,192,192);
     // Vertical road
     
-    SDL_Rect verticalRoad = {WINDOW_WIDTH / 2 - ROAD_WIDTH / 2, 0, ROAD_WIDTH, WINDOW_HEIGHT};
+    SDL_Rect verticalRoad = {WINDOW_WIDTH / 2 - junction.roadWidth / 2, 0, junction.roadWidth, WINDOW_HEIGHT};
     SDL_RenderFillRect(renderer, &verticalRoad);
 
     // Horizontal road
-    SDL_Rect horizontalRoad = {0, WINDOW_HEIGHT / 2 - ROAD_WIDTH / 2, WINDOW_WIDTH, ROAD_WIDTH};
+    SDL_Rect horizontalRoad = {0, WINDOW_HEIGHT / 2 - junction.roadWidth / 2, WINDOW_WIDTH, junction.roadWidth};
     SDL_RenderFillRect(renderer, &horizontalRoad);
     // draw horizontal lanes
     SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
 
-        SDL_RenderDrawLine(renderer, WINDOW_WIDTH/2-ROAD_WIDTH/2, WINDOW_HEIGHT/2+ROAD_WIDTH/2, WINDOW_WIDTH/2+ROAD_WIDTH/2, WINDOW_HEIGHT/2+ROAD_WIDTH/2);
-        SDL_RenderDrawLine(renderer, WINDOW_WIDTH/2+ROAD_WIDTH/2, WINDOW_HEIGHT/2-ROAD_WIDTH/2, WINDOW_WIDTH/2-ROAD_WIDTH/2, WINDOW_HEIGHT/2-ROAD_WIDTH/2);
-        SDL_RenderDrawLine(renderer, WINDOW_WIDTH/2-ROAD_WIDTH/2, WINDOW_HEIGHT/2+ROAD_WIDTH/2, WINDOW_WIDTH/2-ROAD_WIDTH/2, WINDOW_HEIGHT/2-ROAD_WIDTH/2);
-        SDL_RenderDrawLine(renderer, WINDOW_WIDTH/2+ROAD_WIDTH/2, WINDOW_HEIGHT/2+ROAD_WIDTH/2, WINDOW_WIDTH/2+ROAD_WIDTH/2, WINDOW_HEIGHT/2-ROAD_WIDTH/2);
+        SDL_RenderDrawLine(renderer, WINDOW_WIDTH/2-junction.roadWidth/2, WINDOW_HEIGHT/2+junction.roadWidth/2, WINDOW_WIDTH/2+junction.roadWidth/2, WINDOW_HEIGHT/2+junction.roadWidth/2);
+        SDL_RenderDrawLine(renderer, WINDOW_WIDTH/2+junction.roadWidth/2, WINDOW_HEIGHT/2-junction.roadWidth/2, WINDOW_WIDTH/2-junction.roadWidth/2, WINDOW_HEIGHT/2-junction.roadWidth/2);
+        SDL_RenderDrawLine(renderer, WINDOW_WIDTH/2-junction.roadWidth/2, WINDOW_HEIGHT/2+junction.roadWidth/2, WINDOW_WIDTH/2-junction.roadWidth/2, WINDOW_HEIGHT/2-junction.roadWidth/2);
+        SDL_RenderDrawLine(renderer, WINDOW_WIDTH/2+junction.roadWidth/2, WINDOW_HEIGHT/2+junction.roadWidth/2, WINDOW_WIDTH/2+junction.roadWidth/2, WINDOW_HEIGHT/2-junction.roadWidth/2);
         //Road Outlines
         //i=0
         // Horizontal lanes
        
         SDL_RenderDrawLine(renderer, 
-            0, WINDOW_HEIGHT/2 - ROAD_WIDTH/2 + LANE_WIDTH*0,  // x1,y1
-            WINDOW_WIDTH/2 - ROAD_WIDTH/2, WINDOW_HEIGHT/2 - ROAD_WIDTH/2 + LANE_WIDTH*0 // x2, y2
+            0, WINDOW_HEIGHT/2 - junction.roadWidth/2 + junction.laneWidth*0,  // x1,y1
+            WINDOW_WIDTH/2 - junction.roadWidth/2, WINDOW_HEIGHT/2 - junction.roadWidth/2 + junction.laneWidth*0 // x2, y2
         );
         SDL_RenderDrawLine(renderer, 
-            800, WINDOW_HEIGHT/2 - ROAD_WIDTH/2 + LANE_WIDTH*0,
-            WINDOW_WIDTH/2 + ROAD_WIDTH/2, WINDOW_HEIGHT/2 - ROAD_WIDTH/2 + LANE_WIDTH*0
+            800, WINDOW_HEIGHT/2 - junction.roadWidth/2 + junction.laneWidth*0,
+            WINDOW_WIDTH/2 + junction.roadWidth/2, WINDOW_HEIGHT/2 - junction.roadWidth/2 + junction.laneWidth*0
         );
         // Vertical lanes
         SDL_RenderDrawLine(renderer,
-            WINDOW_WIDTH/2 - ROAD_WIDTH/2 + LANE_WIDTH*0, 0,
-            WINDOW_WIDTH/2 - ROAD_WIDTH/2 + LANE_WIDTH*0, WINDOW_HEIGHT/2 - ROAD_WIDTH/2
+            WINDOW_WIDTH/2 - junction.roadWidth/2 + junction.laneWidth*0, 0,
+            WINDOW_WIDTH/2 - junction.roadWidth/2 + junction.laneWidth*0, WINDOW_HEIGHT/2 - junction.roadWidth/2
         );
         SDL_RenderDrawLine(renderer,
-            WINDOW_WIDTH/2 - ROAD_WIDTH/2 + LANE_WIDTH*0, 800,
-            WINDOW_WIDTH/2 - ROAD_WIDTH/2 + LANE_WIDTH*0, WINDOW_HEIGHT/2 + ROAD_WIDTH/2
+            WINDOW_WIDTH/2 - junction.roadWidth/2 + junction.laneWidth*0, 800,
+            WINDOW_WIDTH/2 - junction.roadWidth/2 + junction.laneWidth*0, WINDOW_HEIGHT/2 + junction.roadWidth/2
         );
         //i=3
         //Horizontal Lines
         SDL_RenderDrawLine(renderer, 
-            0, WINDOW_HEIGHT/2 - ROAD_WIDTH/2 + LANE_WIDTH*3,  // x1,y1
-            WINDOW_WIDTH/2 - ROAD_WIDTH/2, WINDOW_HEIGHT/2 - ROAD_WIDTH/2 + LANE_WIDTH*3 // x2, y2
+            0, WINDOW_HEIGHT/2 - junction.roadWidth/2 + junction.laneWidth*3,  // x1,y1
+            WINDOW_WIDTH/2 - junction.roadWidth/2, WINDOW_HEIGHT/2 - junction.roadWidth/2 + junction.laneWidth*3 // x2, y2
         );
         SDL_RenderDrawLine(renderer, 
-            800, WINDOW_HEIGHT/2 - ROAD_WIDTH/2 + LANE_WIDTH*3,
-            WINDOW_WIDTH/2 + ROAD_WIDTH/2, WINDOW_HEIGHT/2 - ROAD_WIDTH/2 + LANE_WIDTH*3
+            800, WINDOW_HEIGHT/2 - junction.roadWidth/2 + junction.laneWidth*3,
+            WINDOW_WIDTH/2 + junction.roadWidth/2, WINDOW_HEIGHT/2 - junction.roadWidth/2 + junction.laneWidth*3
         );
         // Vertical lanes
         SDL_RenderDrawLine(renderer,
-            WINDOW_WIDTH/2 - ROAD_WIDTH/2 + LANE_WIDTH*3, 0,
-            WINDOW_WIDTH/2 - ROAD_WIDTH/2 + LANE_WIDTH*3, WINDOW_HEIGHT/2 - ROAD_WIDTH/2
+            WINDOW_WIDTH/2 - junction.roadWidth/2 + junction.laneWidth*3, 0,
+            WINDOW_WIDTH/2 - junction.roadWidth/2 + junction.laneWidth*3, WINDOW_HEIGHT/2 - junction.roadWidth/2
         );
         SDL_RenderDrawLine(renderer,
-            WINDOW_WIDTH/2 - ROAD_WIDTH/2 + LANE_WIDTH*3, 800,
-            WINDOW_WIDTH/2 - ROAD_WIDTH/2 + LANE_WIDTH*3, WINDOW_HEIGHT/2 + ROAD_WIDTH/2
+            WINDOW_WIDTH/2 - junction.roadWidth/2 + junction.laneWidth*3, 800,
+            WINDOW_WIDTH/2 - junction.roadWidth/2 + junction.laneWidth*3, WINDOW_HEIGHT/2 + junction.roadWidth/2
         );
         //Central part lanes
         //Horizontal Lines
         SDL_RenderDrawLine(renderer, 
-            0, WINDOW_HEIGHT/2 - ROAD_WIDTH/4,  // x1,y1
-            WINDOW_WIDTH/2 - ROAD_WIDTH/2, WINDOW_HEIGHT/2 - ROAD_WIDTH/4 // x2, y2
+            0, WINDOW_HEIGHT/2 - junction.roadWidth/4,  // x1,y1
+            WINDOW_WIDTH/2 - junction.roadWidth/2, WINDOW_HEIGHT/2 - junction.roadWidth/4 // x2, y2
         );
         SDL_RenderDrawLine(renderer, 
-            800, WINDOW_HEIGHT/2 + ROAD_WIDTH/4,
-            WINDOW_WIDTH/2 + ROAD_WIDTH/2, WINDOW_HEIGHT/2 + ROAD_WIDTH/4
+            800, WINDOW_HEIGHT/2 + junction.roadWidth/4,
+            WINDOW_WIDTH/2 + junction.roadWidth/2, WINDOW_HEIGHT/2 + junction.roadWidth/4
         );
         // Vertical lanes
         SDL_RenderDrawLine(renderer,
-            WINDOW_WIDTH/2 + ROAD_WIDTH/4, 0,
-            WINDOW_WIDTH/2 + ROAD_WIDTH/4, WINDOW_HEIGHT/2 - ROAD_WIDTH/2
+            WINDOW_WIDTH/2 + junction.roadWidth/4, 0,
+            WINDOW_WIDTH/2 + junction.roadWidth/4, WINDOW_HEIGHT/2 - junction.roadWidth/2
         );
         SDL_RenderDrawLine(renderer,
-            WINDOW_WIDTH/2 - ROAD_WIDTH/4, 800,
-            WINDOW_WIDTH/2 - ROAD_WIDTH/4, WINDOW_HEIGHT/2 + ROAD_WIDTH/2
+            WINDOW_WIDTH/2 - junction.roadWidth/4, 800,
+            WINDOW_WIDTH/2 - junction.roadWidth/4, WINDOW_HEIGHT/2 + junction.roadWidth/2
         );
 
         //Pass lanes
         //Horizontal lanes
         SDL_RenderDrawLine(renderer, 
             0, WINDOW_HEIGHT/2,
-            WINDOW_WIDTH/2 - ROAD_WIDTH/2,  WINDOW_HEIGHT/2
+            WINDOW_WIDTH/2 - junction.roadWidth/2,  WINDOW_HEIGHT/2
         );
         SDL_RenderDrawLine(renderer, 
             800, WINDOW_HEIGHT/2,
-            WINDOW_WIDTH/2 + ROAD_WIDTH/2, WINDOW_HEIGHT/2 
+            WINDOW_WIDTH/2 + junction.roadWidth/2, WINDOW_HEIGHT/2 
          );
          //Vertical Lanes
         SDL_RenderDrawLine(renderer,
             WINDOW_WIDTH/2 , 0,
-            WINDOW_WIDTH/2 , WINDOW_HEIGHT/2 - ROAD_WIDTH/2
+            WINDOW_WIDTH/2 , WINDOW_HEIGHT/2 - junction.roadWidth/2
         );
         SDL_RenderDrawLine(renderer,
             WINDOW_WIDTH/2 , 800,
-            WINDOW_WIDTH/2 , WINDOW_HEIGHT/2 + ROAD_WIDTH/2
+            WINDOW_WIDTH/2 , WINDOW_HEIGHT/2 + junction.roadWidth/2
         );
 }
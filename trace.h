@@ -0,0 +1,133 @@
+// Timeline tracing of the simulator threads in Chrome trace JSON, viewable in
+// chrome://tracing or ui.perfetto.dev. Compiled in only with -DENABLE_TRACE;
+// otherwise every TRACE_* macro expands to nothing.
+//
+// Each thread that calls TRACE_THREAD gets its own event buffer. Only the
+// owner appends to it and publishes each event with a release store of the
+// count, so recording takes no lock and traceWrite() can read the buffers
+// while the threads keep running. A full buffer drops further events.
+#ifndef TRACE_H
+#define TRACE_H
+
+#ifdef ENABLE_TRACE
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_MAX_THREADS 16
+#define TRACE_EVENTS_PER_THREAD (1 << 18)
+
+typedef struct {
+    const char* name;  // string literal
+    uint64_t startNs;
+    uint64_t durationNs;
+} TraceEvent;
+
+typedef struct {
+    _Atomic bool ready;       // set once name and events are valid
+    const char* name;
+    TraceEvent* events;
+    _Atomic uint32_t count;
+    _Atomic uint32_t dropped;
+} TraceBuffer;
+
+typedef struct {
+    const char* name;
+    uint64_t startNs;
+} TraceScope;
+
+static TraceBuffer traceBuffers[TRACE_MAX_THREADS];
+static atomic_int traceThreadCount;
+static _Thread_local TraceBuffer* traceLocal;
+
+static inline uint64_t traceNow() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Give the calling thread a buffer, shown as a track named name
+static inline void traceThread(const char* name) {
+    int slot = atomic_fetch_add(&traceThreadCount, 1);
+    if (slot >= TRACE_MAX_THREADS) return;
+    TraceBuffer* buffer = &traceBuffers[slot];
+    buffer->events = malloc(TRACE_EVENTS_PER_THREAD * sizeof(TraceEvent));
+    if (!buffer->events) return;
+    buffer->name = name;
+    atomic_store_explicit(&buffer->ready, true, memory_order_release);
+    traceLocal = buffer;
+}
+
+// Cleanup handler of TRACE_SCOPE: record the scope as one complete event
+static inline void traceEnd(TraceScope* scope) {
+    TraceBuffer* buffer = traceLocal;
+    if (!buffer) return;
+    uint32_t n = atomic_load_explicit(&buffer->count, memory_order_relaxed);
+    if (n == TRACE_EVENTS_PER_THREAD) {
+        atomic_fetch_add_explicit(&buffer->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    buffer->events[n] = (TraceEvent){scope->name, scope->startNs, traceNow() - scope->startNs};
+    atomic_store_explicit(&buffer->count, n + 1, memory_order_release);
+}
+
+// Write every event recorded so far as a Chrome trace
+static inline bool traceWrite(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        perror(path);
+        return false;
+    }
+
+    int pid = (int)getpid();
+    int threads = atomic_load(&traceThreadCount);
+    if (threads > TRACE_MAX_THREADS) threads = TRACE_MAX_THREADS;
+    long long events = 0, dropped = 0;
+    bool first = true;
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (int t = 0; t < threads; t++) {
+        TraceBuffer* buffer = &traceBuffers[t];
+        if (!atomic_load_explicit(&buffer->ready, memory_order_acquire)) continue;
+        fprintf(file, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", pid, t + 1, buffer->name);
+        first = false;
+
+        uint32_t count = atomic_load_explicit(&buffer->count, memory_order_acquire);
+        for (uint32_t n = 0; n < count; n++) {
+            const TraceEvent* event = &buffer->events[n];
+            fprintf(file, ",\n{\"ph\":\"X\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", event->name,
+                    pid, t + 1, event->startNs / 1000.0, event->durationNs / 1000.0);
+        }
+        events += count;
+        dropped += atomic_load_explicit(&buffer->dropped, memory_order_relaxed);
+    }
+    fprintf(file, "\n]}\n");
+
+    bool ok = fclose(file) == 0;
+    printf("Trace written to %s (%lld events, %lld dropped)\n", path, events, dropped);
+    return ok;
+}
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+// Time the rest of the enclosing block
+#define TRACE_SCOPE(label) \
+    TraceScope TRACE_CONCAT(traceScope, __LINE__) __attribute__((cleanup(traceEnd))) = {label, traceNow()}
+#define TRACE_THREAD(label) traceThread(label)
+#define TRACE_WRITE(path) traceWrite(path)
+
+#else
+
+#define TRACE_SCOPE(label) do {} while (0)
+#define TRACE_THREAD(label) do {} while (0)
+#define TRACE_WRITE(path) do {} while (0)
+
+#endif
+
+#endif
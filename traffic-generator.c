@@ -1,13 +1,18 @@
+#define _GNU_SOURCE // sendmmsg()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <errno.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <time.h>
+#include "vehicle_record.h"
 
 #define SERVER_IP "0.0.0.0" // for all network available
 #define PORT 5000
 #define BUFFER_SIZE 100
+#define MAX_UDP_BATCH 64 // datagrams per sendmmsg() call
 
 // Generate a random vehicle number
 void generateVehicleNumber(char* buffer) {
@@ -28,15 +33,103 @@ char generateLane() {
     return lanes[rand() % 4];
 }
 
-int main() {
+// ** UDP mode: pack DATAGRAM_RECORDS records per datagram, batch datagrams per sendmmsg() **
+// rate is in records per second, 0 sends as fast as the socket takes them
+void sendDatagrams(struct sockaddr_in* server_address, int batch, long rate) {
+    static VehicleDatagram datagrams[MAX_UDP_BATCH];
+    struct mmsghdr messages[MAX_UDP_BATCH];
+    struct iovec iov[MAX_UDP_BATCH];
+    char vehicle[9];
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        perror("Socket failed");
+        exit(EXIT_FAILURE);
+    }
+    if (connect(sock, (struct sockaddr*)server_address, sizeof(*server_address)) < 0) {
+        perror("Connection failed");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(messages, 0, sizeof(messages));
+    for (int i = 0; i < batch; i++) {
+        iov[i].iov_base = &datagrams[i];
+        iov[i].iov_len = sizeof(VehicleDatagram);
+        messages[i].msg_hdr.msg_iov = &iov[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    // Sequence numbers restart with every run, so each run is a new source
+    uint32_t source = (uint32_t)time(NULL) * 2654435761u ^ (uint32_t)getpid();
+    uint32_t sequence = 0;
+    long long sent = 0, reported = 0;
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    time_t nextReport = start.tv_sec + 1;
+    printf("Sending datagrams of %d records, %d per call, source %08x...\n", DATAGRAM_RECORDS, batch, source);
+
+    while (1) {
+        for (int i = 0; i < batch; i++) {
+            datagrams[i].header.source = source;
+            datagrams[i].header.sequence = sequence++;
+            datagrams[i].header.count = DATAGRAM_RECORDS;
+            for (int r = 0; r < DATAGRAM_RECORDS; r++) {
+                generateVehicleNumber(vehicle);
+                memcpy(datagrams[i].records[r].plate, vehicle, PLATE_LENGTH);
+                datagrams[i].records[r].lane = generateLane();
+            }
+        }
+
+        for (int done = 0; done < batch;) {
+            int n = sendmmsg(sock, messages + done, batch - done, 0);
+            if (n < 0) {
+                // Refused: nobody listening yet, the datagram is simply lost
+                if (errno != ECONNREFUSED && errno != EINTR) {
+                    perror("Send failed");
+                    sleep(1);
+                }
+                if (errno == ECONNREFUSED) done++;
+                continue;
+            }
+            done += n;
+        }
+        sent += (long long)batch * DATAGRAM_RECORDS;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (rate > 0) {
+            // Sleep until the records sent so far are due
+            double due = (double)sent / rate;
+            double elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+            if (due > elapsed) usleep((useconds_t)((due - elapsed) * 1e6));
+        }
+        if (now.tv_sec >= nextReport) {
+            printf("Sent %lld records/s\n", sent - reported);
+            reported = sent;
+            nextReport = now.tv_sec + 1;
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
     int sock;
     struct sockaddr_in server_address;
     char buffer[BUFFER_SIZE];
+    bool useUdp = false;
+    int batch = 16;
+    long rate = 0;
 
-    // Create socket
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("Socket failed");
-        exit(EXIT_FAILURE);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--udp") == 0) {
+            useUdp = true;
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc &&
+                   atoi(argv[i + 1]) > 0 && atoi(argv[i + 1]) <= MAX_UDP_BATCH) {
+            batch = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc && atol(argv[i + 1]) >= 0) {
+            rate = atol(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--udp [--batch N] [--rate RECORDS_PER_SEC]]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
     }
 
     server_address.sin_family = AF_INET;
@@ -47,6 +140,19 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
+    srand(time(NULL));
+
+    if (useUdp) {
+        sendDatagrams(&server_address, batch, rate);
+        return 0;
+    }
+
+    // Create socket
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("Socket failed");
+        exit(EXIT_FAILURE);
+    }
+
     // Connect to the server
     if (connect(sock, (struct sockaddr*)&server_address, sizeof(server_address)) < 0) {
         perror("Connection failed");
@@ -55,18 +161,17 @@ int main() {
 
     printf("Connected to server...\n");
 
-    srand(time(NULL));
-
     while (1) {
         char vehicle[9];
         generateVehicleNumber(vehicle);
         char lane = generateLane();
 
-        snprintf(buffer, BUFFER_SIZE, "%s:%c", vehicle, lane);
+        // Records are newline terminated so they can be streamed back to back
+        snprintf(buffer, BUFFER_SIZE, "%s:%c\n", vehicle, lane);
 
         // Send message
         send(sock, buffer, strlen(buffer), 0);
-        printf("Sent: %s\n", buffer);
+        printf("Sent: %s", buffer);
 
         sleep(1);
     }
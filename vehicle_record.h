@@ -0,0 +1,71 @@
+// Fixed-size vehicle records shared by the binary transports (shared-memory
+// ring and UDP datagrams), and the datagram framing used over UDP.
+#ifndef VEHICLE_RECORD_H
+#define VEHICLE_RECORD_H
+
+#include <stdint.h>
+
+#define PLATE_LENGTH 8
+#define DATAGRAM_RECORDS 64 // 16 + 64 * 16 = 1040 bytes, below a 1500 byte MTU
+#define MAX_DATAGRAM_SOURCES 64
+
+typedef struct {
+    char plate[PLATE_LENGTH]; // not null terminated
+    char lane;
+    char reserved[7];
+} VehicleRecord;
+
+// Every datagram carries its sender's id and a per-sender sequence number,
+// so receivers can count datagrams lost on the way.
+typedef struct {
+    uint32_t source;
+    uint32_t sequence;
+    uint16_t count;       // records that follow
+    uint16_t reserved[3];
+} DatagramHeader;
+
+typedef struct {
+    DatagramHeader header;
+    VehicleRecord records[DATAGRAM_RECORDS];
+} VehicleDatagram;
+
+typedef struct {
+    int sources;
+    uint32_t source[MAX_DATAGRAM_SOURCES];
+    uint32_t nextSequence[MAX_DATAGRAM_SOURCES];
+    uint64_t datagrams;
+    uint64_t records;
+    uint64_t lost;        // sequence numbers skipped
+    uint64_t late;        // arrived after a later datagram, or duplicated
+} DatagramLoss;
+
+// Account for one received datagram; false if it is malformed
+static inline int trackDatagram(DatagramLoss* loss, const VehicleDatagram* datagram, long size) {
+    if (size < (long)sizeof(DatagramHeader) || datagram->header.count > DATAGRAM_RECORDS ||
+        size < (long)(sizeof(DatagramHeader) + datagram->header.count * sizeof(VehicleRecord))) {
+        return 0;
+    }
+
+    int slot = 0;
+    while (slot < loss->sources && loss->source[slot] != datagram->header.source) slot++;
+    if (slot == loss->sources) {
+        if (loss->sources == MAX_DATAGRAM_SOURCES) slot = MAX_DATAGRAM_SOURCES - 1; // reuse the last slot
+        else loss->sources++;
+        loss->source[slot] = datagram->header.source;
+        loss->nextSequence[slot] = datagram->header.sequence;
+    }
+
+    uint32_t expected = loss->nextSequence[slot];
+    int32_t ahead = (int32_t)(datagram->header.sequence - expected);
+    if (ahead >= 0) {
+        loss->lost += ahead;
+        loss->nextSequence[slot] = datagram->header.sequence + 1;
+    } else {
+        loss->late++;
+    }
+    loss->datagrams++;
+    loss->records += datagram->header.count;
+    return 1;
+}
+
+#endif
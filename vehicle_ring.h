@@ -0,0 +1,120 @@
+// Shared-memory transport between receiver and simulator on the same host:
+// a single-producer/single-consumer ring of fixed-size vehicle records in a
+// named POSIX shm segment. The consumer spins briefly when the ring is empty
+// and then parks on a futex; the producer only makes the wake syscall when
+// the consumer has parked. The same holds in reverse when the ring is full.
+#ifndef VEHICLE_RING_H
+#define VEHICLE_RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "vehicle_record.h"
+
+#define VEHICLE_RING_NAME "/dsa-queue-simulator"
+#define VEHICLE_RING_SLOTS 4096 // power of two
+#define VEHICLE_RING_MAGIC 0x56524E47u
+#define VEHICLE_RING_SPIN 4000 // polls before parking on the futex
+
+typedef struct {
+    _Atomic uint32_t magic;
+    char pad0[60];
+    _Atomic uint32_t head;            // next slot to write, producer only
+    _Atomic uint32_t consumerParked;
+    char pad1[56];
+    _Atomic uint32_t tail;            // next slot to read, consumer only
+    _Atomic uint32_t producerParked;
+    char pad2[56];
+    VehicleRecord slots[VEHICLE_RING_SLOTS];
+} VehicleRing;
+
+static inline long vehicleRingFutex(_Atomic uint32_t* word, int op, uint32_t value, const struct timespec* timeout) {
+    return syscall(SYS_futex, (uint32_t*)word, op, value, timeout, NULL, 0);
+}
+
+// Map the ring, creating it on first use. Both sides may call this in any order;
+// a new segment is zero filled, which is an empty ring.
+static inline VehicleRing* vehicleRingOpen(const char* name) {
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        perror("shm_open failed");
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(VehicleRing)) < 0) {
+        perror("ftruncate failed");
+        close(fd);
+        return NULL;
+    }
+    VehicleRing* ring = mmap(NULL, sizeof(VehicleRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED) {
+        perror("mmap failed");
+        return NULL;
+    }
+
+    uint32_t expected = 0;
+    if (!atomic_compare_exchange_strong(&ring->magic, &expected, VEHICLE_RING_MAGIC) &&
+        expected != VEHICLE_RING_MAGIC) {
+        fprintf(stderr, "%s is not a vehicle ring\n", name);
+        munmap(ring, sizeof(VehicleRing));
+        return NULL;
+    }
+    return ring;
+}
+
+// Wait until *word differs from seen: spin first, then park with parked set.
+// The seq_cst store of parked and the re-check pair with the other side's
+// seq_cst publish and load of parked, so a wake-up cannot be missed.
+static inline void vehicleRingWait(_Atomic uint32_t* word, uint32_t seen, _Atomic uint32_t* parked) {
+    for (int i = 0; i < VEHICLE_RING_SPIN; i++) {
+        if (atomic_load_explicit(word, memory_order_acquire) != seen) return;
+    }
+    atomic_store(parked, 1);
+    if (atomic_load(word) == seen) {
+        struct timespec timeout = {1, 0};  // bounded, so shutdown flags get re-checked
+        vehicleRingFutex(word, FUTEX_WAIT, seen, &timeout);
+    }
+    atomic_store(parked, 0);
+}
+
+static inline void vehicleRingWake(_Atomic uint32_t* word, _Atomic uint32_t* parked) {
+    if (atomic_load(parked)) vehicleRingFutex(word, FUTEX_WAKE, 1, NULL);
+}
+
+// Producer: blocks while the ring is full
+static inline void vehicleRingPush(VehicleRing* ring, const VehicleRecord* record) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail;
+    while (head - (tail = atomic_load_explicit(&ring->tail, memory_order_acquire)) == VEHICLE_RING_SLOTS) {
+        vehicleRingWait(&ring->tail, tail, &ring->producerParked);
+    }
+    ring->slots[head & (VEHICLE_RING_SLOTS - 1)] = *record;
+    atomic_store(&ring->head, head + 1);
+    vehicleRingWake(&ring->head, &ring->consumerParked);
+}
+
+// Consumer: false when nothing arrived within the park timeout
+static inline bool vehicleRingPop(VehicleRing* ring, VehicleRecord* record) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (head == tail) {
+        vehicleRingWait(&ring->head, head, &ring->consumerParked);
+        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (head == tail) return false;
+    }
+    *record = ring->slots[tail & (VEHICLE_RING_SLOTS - 1)];
+    atomic_store(&ring->tail, tail + 1);
+    vehicleRingWake(&ring->tail, &ring->producerParked);
+    return true;
+}
+
+#endif